@@ -0,0 +1,115 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN (_Alignof(max_align_t))
+
+/* Allocate a new block with room for at least size bytes */
+static ArenaBlock *arena_block_new(size_t size)
+{
+  ArenaBlock *b = malloc(sizeof(ArenaBlock) + size);
+  if (!b)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+/**
+ * @Brief Create a new Arena
+ *
+ * @param block_size Default capacity of each block
+ * @return Pointer to a newly created Arena
+ */
+Arena *arena_create(size_t block_size)
+{
+  Arena *a = malloc(sizeof(Arena));
+  if (!a)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+  a->block_size = block_size;
+  a->head = arena_block_new(block_size);
+  a->cur = a->head;
+  return a;
+}
+
+/**
+ * @Brief Bump-allocate n bytes from the arena
+ *
+ * Moves on to the next retained block (or chains a new one, sized to fit n)
+ * when the current block is full.
+ *
+ * @param a Pointer to the Arena
+ * @param n Number of bytes
+ * @return Pointer to the allocated memory
+ */
+void *arena_alloc(Arena *a, size_t n)
+{
+  size_t offset = (a->cur->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  while (offset + n > a->cur->size)
+  {
+    ArenaBlock *next = a->cur->next;
+    if (!next || next->size < n)
+    {
+      ArenaBlock *b = arena_block_new(n > a->block_size ? n : a->block_size);
+      b->next = next;
+      a->cur->next = b;
+      next = b;
+    }
+    a->cur = next;
+    a->cur->used = 0;
+    offset = 0;
+  }
+  a->cur->used = offset + n;
+  return a->cur->data + offset;
+}
+
+/* Allocate zeroed memory for count elements of size bytes each */
+void *arena_calloc(Arena *a, size_t count, size_t size)
+{
+  if (size != 0 && count > SIZE_MAX / size)
+  {
+    fprintf(stderr, "arena_calloc: size overflow\n");
+    exit(-1);
+  }
+  void *p = arena_alloc(a, count * size);
+  memset(p, 0, count * size);
+  return p;
+}
+
+/* Copy a string into the arena */
+char *arena_strdup(Arena *a, const char *s)
+{
+  size_t len = strlen(s) + 1;
+  char *copy = arena_alloc(a, len);
+  memcpy(copy, s, len);
+  return copy;
+}
+
+/* Release every allocation; later blocks are reset lazily as they are reached */
+void arena_reset(Arena *a)
+{
+  a->cur = a->head;
+  a->head->used = 0;
+}
+
+/* Free the memory used by the arena */
+void arena_free(Arena *a)
+{
+  ArenaBlock *b = a->head;
+  while (b)
+  {
+    ArenaBlock *next = b->next;
+    free(b);
+    b = next;
+  }
+  free(a);
+}
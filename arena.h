@@ -0,0 +1,39 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// One chunk of arena memory; blocks are chained and reused across resets
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size; // Usable bytes in data
+    size_t used; // Bytes handed out from data
+    _Alignas(max_align_t) char data[]; // Starts max_align_t-aligned, as malloc'ed memory does
+} ArenaBlock;
+
+// Bump allocator: individual allocations are never freed, only the whole arena
+typedef struct {
+    ArenaBlock *head; // First block, kept across resets
+    ArenaBlock *cur;  // Block currently being bumped
+    size_t block_size; // Default size of new blocks
+} Arena;
+
+// Create a new Arena whose blocks hold at least block_size bytes
+Arena *arena_create(size_t block_size);
+
+// Allocate n bytes (suitably aligned for any type). Never returns NULL
+void *arena_alloc(Arena *a, size_t n);
+
+// Allocate zeroed memory for count elements of size bytes each
+void *arena_calloc(Arena *a, size_t count, size_t size);
+
+// Copy a string into the arena
+char *arena_strdup(Arena *a, const char *s);
+
+// Release every allocation at once in O(1); blocks are kept for reuse
+void arena_reset(Arena *a);
+
+// Free whole Arena
+void arena_free(Arena *a);
+
+#endif // ARENA_H
@@ -0,0 +1,365 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+extern char **environ;
+
+static const char *shell_names[] = {"wsh", "sh"};
+static char tmp_dir[] = "/tmp/wsh-bench.XXXXXX";
+
+static void gen_empty(StrBuf *sb, int dialect, int count, int arg)
+{
+  (void)sb, (void)dialect, (void)count, (void)arg;
+}
+
+static void gen_external(StrBuf *sb, int dialect, int count, int arg)
+{
+  (void)dialect, (void)arg;
+  for (int i = 0; i < count; i++)
+    sb_puts(sb, "/bin/true\n");
+}
+
+static void gen_builtin(StrBuf *sb, int dialect, int count, int arg)
+{
+  (void)dialect, (void)arg;
+  for (int i = 0; i < count; i++)
+    sb_puts(sb, "cd .\n");
+}
+
+/* arg stages: one echo feeding arg - 1 cats */
+static void gen_pipeline(StrBuf *sb, int dialect, int count, int arg)
+{
+  (void)dialect;
+  for (int i = 0; i < count; i++)
+  {
+    sb_puts(sb, "/bin/echo x");
+    for (int s = 1; s < arg; s++)
+      sb_puts(sb, " | /bin/cat");
+    sb_puts(sb, "\n");
+  }
+}
+
+/*
+ * Lines of arg words, two thirds of them single-quoted (the only quoting
+ * wsh has, so both shells split them the same way), given to cd so that both
+ * shells tokenize the whole line and then fail cheaply on the extra words.
+ */
+static void gen_parse(StrBuf *sb, int dialect, int count, int arg)
+{
+  (void)dialect;
+  for (int i = 0; i < count; i++)
+  {
+    sb_puts(sb, "cd");
+    for (int w = 0; w < arg; w++)
+    {
+      switch (w % 3)
+      {
+      case 0:
+        sb_printf(sb, " word%d", w);
+        break;
+      case 1:
+        sb_printf(sb, " 'two %d'", w);
+        break;
+      default:
+        sb_printf(sb, " 'q%d'", w);
+        break;
+      }
+    }
+    sb_puts(sb, "\n");
+  }
+}
+
+/* arg aliases for "cd .", then count lines each using one of them */
+static void gen_alias(StrBuf *sb, int dialect, int count, int arg)
+{
+  for (int a = 0; a < arg; a++)
+    sb_printf(sb, dialect == BENCH_DIALECT_WSH ? "alias al%d = 'cd .'\n" : "alias al%d='cd .'\n", a);
+  for (int i = 0; i < count; i++)
+    sb_printf(sb, "al%d\n", i % arg);
+}
+
+static const BenchCase cases[] = {
+    {"startup-cold", "us/run", 0, 0, 1, gen_empty},
+    {"startup-warm", "us/run", 0, 0, 0, gen_empty},
+    {"external", "us/cmd", 100, 0, 0, gen_external},
+    {"builtin", "us/cmd", 2000, 0, 0, gen_builtin},
+    {"pipeline-2", "us/pipe", 20, 2, 0, gen_pipeline},
+    {"pipeline-8", "us/pipe", 20, 8, 0, gen_pipeline},
+    {"pipeline-32", "us/pipe", 5, 32, 0, gen_pipeline},
+    {"parse-100w", "us/line", 2000, 100, 0, gen_parse},
+    {"alias-500", "us/line", 5000, 500, 0, gen_alias},
+};
+
+static double now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples */
+static double percentile(const double *sorted, int n, int p)
+{
+  int idx = (p * n + 99) / 100 - 1;
+  if (idx < 0)
+    idx = 0;
+  return sorted[idx];
+}
+
+/**
+ * @Brief Write a generated script, dated in the past so the script cache
+ * will accept it
+ *
+ * @return 0 on success, -1 on error
+ */
+static int write_script(const char *path, const StrBuf *sb)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  int ret = sb_write_fd(sb, fd);
+  struct timespec times[2];
+  clock_gettime(CLOCK_REALTIME, &times[0]);
+  times[0].tv_sec -= 3600;
+  times[1] = times[0];
+  if (futimens(fd, times) < 0)
+    ret = -1;
+  if (close(fd) < 0)
+    ret = -1;
+  return ret;
+}
+
+/* Remove a directory of plain files (the script cache) */
+static void remove_dir(const char *path)
+{
+  DIR *dir = opendir(path);
+  if (!dir)
+    return;
+  struct dirent *de;
+  while ((de = readdir(dir)))
+    if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+      unlinkat(dirfd(dir), de->d_name, 0);
+  closedir(dir);
+  rmdir(path);
+}
+
+/* Ask the kernel to drop the shell binary's cached pages */
+static void evict(const char *shell)
+{
+  int fd = open(shell, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+/**
+ * @Brief Run shell on script once with all standard streams on /dev/null
+ *
+ * @return Wall time in microseconds, or -1 if the shell could not be run
+ */
+static double run_once(const char *shell, const char *script)
+{
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&fa, STDOUT_FILENO, STDERR_FILENO);
+
+  char *argv[] = {(char *)shell, (char *)script, NULL};
+  double start = now_us();
+  pid_t pid;
+  int err = posix_spawn(&pid, shell, &fa, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  if (err != 0)
+    return -1;
+  int status;
+  if (waitpid(pid, &status, 0) < 0)
+    return -1;
+  double elapsed = now_us() - start;
+  if (WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) == 127))
+    return -1;
+  return elapsed;
+}
+
+/**
+ * @Brief Time one case under one shell
+ *
+ * @param samples Filled with runs per-unit costs, sorted
+ * @param baseline Warm startup median subtracted from each run
+ * @return 0 on success, -1 if a run failed
+ */
+static int bench_case(const BenchCase *c, const char *shell, int dialect, int runs,
+                      double baseline, double *samples)
+{
+  char script[PATH_MAX];
+  snprintf(script, sizeof(script), "%s/%s.%s", tmp_dir, c->name, shell_names[dialect]);
+  StrBuf sb = {0};
+  c->gen(&sb, dialect, c->count, c->arg);
+  int ret = write_script(script, &sb);
+  sb_free(&sb);
+  if (ret < 0)
+  {
+    perror(script);
+    return -1;
+  }
+
+  for (int i = 0; !c->cold && i < BENCH_WARMUP; i++)
+    run_once(shell, script);
+
+  for (int i = 0; i < runs; i++)
+  {
+    if (c->cold)
+      evict(shell);
+    double t = run_once(shell, script);
+    if (t < 0)
+    {
+      fprintf(stderr, "wsh-bench: %s failed running %s\n", shell, script);
+      unlink(script);
+      return -1;
+    }
+    samples[i] = c->count ? (t - baseline) / c->count : t;
+  }
+  unlink(script);
+  qsort(samples, runs, sizeof(double), cmp_double);
+  return 0;
+}
+
+static void print_row(const BenchCase *c, int dialect, const double *s, int runs, double ratio)
+{
+  printf("%-14s %-8s %-5s %10.2f %10.2f %10.2f %10.2f",
+         dialect == BENCH_DIALECT_WSH ? c->name : "", dialect == BENCH_DIALECT_WSH ? c->unit : "",
+         shell_names[dialect], percentile(s, runs, 50), percentile(s, runs, 90),
+         percentile(s, runs, 99), s[0]);
+  if (ratio > 0)
+    printf(" %8.2fx", ratio);
+  printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+  int runs = BENCH_RUNS;
+  const char *sh = BENCH_SHELL;
+  const char *filter = NULL;
+  int keep_cache = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:f:C")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      runs = atoi(optarg);
+      break;
+    case 's':
+      sh = optarg;
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    case 'C':
+      keep_cache = 1;
+      break;
+    default:
+      fprintf(stderr, BENCH_USAGE);
+      return EXIT_FAILURE;
+    }
+  }
+  if (runs <= 0 || argc - optind > 1)
+  {
+    fprintf(stderr, BENCH_USAGE);
+    return EXIT_FAILURE;
+  }
+  const char *shells[] = {optind < argc ? argv[optind] : BENCH_WSH, sh};
+
+  if (!mkdtemp(tmp_dir))
+  {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  /* The script cache skips tokenizing on warm runs; measure the parser unless asked */
+  char cache_dir[PATH_MAX];
+  snprintf(cache_dir, sizeof(cache_dir), "%s/cache", tmp_dir);
+  setenv("WSH_SCRIPT_CACHE", keep_cache ? cache_dir : "", 1);
+
+  double *samples[2], *warm_samples[2];
+  for (int d = 0; d < 2; d++)
+  {
+    samples[d] = malloc(runs * sizeof(double));
+    warm_samples[d] = malloc(runs * sizeof(double));
+    if (!samples[d] || !warm_samples[d])
+    {
+      perror("malloc");
+      exit(-1);
+    }
+  }
+
+  printf("wsh-bench: %d runs per case; wsh = %s, sh = %s%s\n", runs, shells[0], shells[1],
+         keep_cache ? " (script cache on)" : "");
+  printf("%-14s %-8s %-5s %10s %10s %10s %10s %9s\n", "case", "unit", "shell", "p50", "p90", "p99",
+         "min", "wsh/sh");
+
+  /* Warm startup is the baseline for the per-unit cases */
+  double baseline[2] = {0, 0};
+  const BenchCase *warm = &cases[1];
+  int rc = EXIT_SUCCESS;
+  for (int d = 0; d < 2; d++)
+  {
+    if (bench_case(warm, shells[d], d, runs, 0, warm_samples[d]) < 0)
+    {
+      rc = EXIT_FAILURE;
+      goto out;
+    }
+    baseline[d] = percentile(warm_samples[d], runs, 50);
+  }
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+  {
+    const BenchCase *c = &cases[i];
+    if (filter && !strstr(c->name, filter))
+      continue;
+    int ok = 1;
+    for (int d = 0; d < 2; d++)
+    {
+      if (c == warm)
+        memcpy(samples[d], warm_samples[d], runs * sizeof(double));
+      else if (bench_case(c, shells[d], d, runs, baseline[d], samples[d]) < 0)
+        ok = 0;
+    }
+    if (!ok)
+    {
+      rc = EXIT_FAILURE;
+      continue;
+    }
+    double p50_sh = percentile(samples[1], runs, 50);
+    print_row(c, BENCH_DIALECT_WSH, samples[0], runs, p50_sh > 0 ? percentile(samples[0], runs, 50) / p50_sh : 0);
+    print_row(c, BENCH_DIALECT_SH, samples[1], runs, 0);
+  }
+
+out:
+  for (int d = 0; d < 2; d++)
+  {
+    free(samples[d]);
+    free(warm_samples[d]);
+  }
+  remove_dir(cache_dir);
+  rmdir(tmp_dir);
+  return rc;
+}
@@ -0,0 +1,29 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "utils.h"
+
+#define BENCH_RUNS 30          /* timed runs per case and shell */
+#define BENCH_WARMUP 3         /* untimed runs before a warm case */
+#define BENCH_SHELL "/bin/sh"  /* shell compared against */
+#define BENCH_WSH "./wsh"
+
+#define BENCH_USAGE "Usage: wsh-bench [-n runs] [-s shell] [-f filter] [-C] [wsh]\n"
+
+// Which dialect a script is generated for
+#define BENCH_DIALECT_WSH 0
+#define BENCH_DIALECT_SH 1
+
+// One benchmark: a script generated per shell and run as a whole. For cases
+// with a non-zero count the warm startup median is subtracted and the rest
+// divided by count, giving the cost of one unit of work
+typedef struct {
+    const char *name;
+    const char *unit;
+    int count;     // Units of work in the script (0: report whole runs)
+    int arg;       // Generator parameter (stages, words, ...)
+    int cold;      // 1 to evict the shell binary from the page cache before each run
+    void (*gen)(StrBuf *sb, int dialect, int count, int arg);
+} BenchCase;
+
+#endif // BENCH_H
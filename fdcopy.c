@@ -0,0 +1,176 @@
+#define _GNU_SOURCE /* splice, tee, copy_file_range */
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fdcopy.h"
+
+#define FDCOPY_CHUNK (1 << 20) /* bytes requested per splice/copy_file_range call */
+#define FDCOPY_BUF (1 << 16)   /* read/write fallback buffer */
+
+static char copy_buf[FDCOPY_BUF];
+
+static int fd_is(int fd, mode_t type)
+{
+  struct stat st;
+  return fstat(fd, &st) == 0 && (st.st_mode & S_IFMT) == type;
+}
+
+/* errno values meaning "this pair of descriptors can't do that", not an I/O error */
+static int kernel_refused(int err)
+{
+  return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EBADF;
+}
+
+static int write_all(int fd, const char *buf, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t w = write(fd, buf, n);
+    if (w < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += w;
+    n -= w;
+  }
+  return 0;
+}
+
+/**
+ * @Brief Copy from in to out and the given files through a user-space buffer
+ *
+ * @param limit Bytes to copy, or -1 to copy until EOF
+ * @return 0 on success, -1 on error
+ */
+static int rw_copy(int in, int out, const int *files, size_t nfiles, long limit)
+{
+  while (limit != 0)
+  {
+    size_t want = FDCOPY_BUF;
+    if (limit > 0 && (size_t)limit < want)
+      want = limit;
+    ssize_t n = read(in, copy_buf, want);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (n == 0)
+      return 0;
+    if (out >= 0 && write_all(out, copy_buf, n) < 0)
+      return -1;
+    for (size_t k = 0; k < nfiles; k++)
+      if (write_all(files[k], copy_buf, n) < 0)
+        return -1;
+    if (limit > 0)
+      limit -= n;
+  }
+  return 0;
+}
+
+/**
+ * @Brief Copy in to out until EOF, without user-space copies where possible
+ *
+ * @param in Descriptor to read from
+ * @param out Descriptor to write to
+ * @return 0 on success, -1 with errno set on error
+ */
+int fd_copy(int in, int out)
+{
+  enum { COPY_RANGE, COPY_SPLICE, COPY_RW } mode = COPY_RW;
+  if (fd_is(in, S_IFREG) && fd_is(out, S_IFREG))
+    mode = COPY_RANGE;
+  else if (fd_is(in, S_IFIFO) || fd_is(out, S_IFIFO))
+    mode = COPY_SPLICE;
+
+  int copied = 0;
+  while (mode != COPY_RW)
+  {
+    ssize_t n;
+    if (mode == COPY_RANGE)
+      n = copy_file_range(in, NULL, out, NULL, FDCOPY_CHUNK, 0);
+    else
+      n = splice(in, NULL, out, NULL, FDCOPY_CHUNK, SPLICE_F_MOVE);
+    /* Pseudo files (procfs, sysfs) report size 0 to copy_file_range; read them */
+    if (n == 0 && mode == COPY_RANGE && !copied)
+    {
+      mode = COPY_RW;
+      break;
+    }
+    if (n == 0)
+      return 0;
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (!kernel_refused(errno))
+        return -1;
+      mode = COPY_RW; /* nothing was moved by the failed call, so just carry on */
+    }
+    else
+    {
+      copied = 1;
+    }
+  }
+  return rw_copy(in, out, NULL, 0, -1);
+}
+
+/**
+ * @Brief Copy in to out and to every file until EOF
+ *
+ * @param in Descriptor to read from
+ * @param out Descriptor to write to
+ * @param files Extra descriptors receiving the same data
+ * @param nfiles Number of extra descriptors
+ * @return 0 on success, -1 with errno set on error
+ */
+int fd_tee(int in, int out, const int *files, size_t nfiles)
+{
+  if (nfiles == 0)
+    return fd_copy(in, out);
+  if (nfiles > 1 || !fd_is(in, S_IFIFO) || !fd_is(out, S_IFIFO))
+    return rw_copy(in, out, files, nfiles, -1);
+
+  /*
+   * tee(2) duplicates what is buffered in the input pipe into the output pipe
+   * without consuming it; the same bytes are then spliced (consumed) into the
+   * file. If the file refuses splice (e.g. O_APPEND), those bytes are read
+   * and written instead.
+   */
+  int splice_file = 1;
+  while (1)
+  {
+    ssize_t n = tee(in, out, FDCOPY_CHUNK, 0);
+    if (n == 0)
+      return 0;
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (kernel_refused(errno))
+        return rw_copy(in, out, files, nfiles, -1);
+      return -1;
+    }
+
+    while (n > 0 && splice_file)
+    {
+      ssize_t m = splice(in, NULL, files[0], NULL, n, SPLICE_F_MOVE);
+      if (m < 0 && errno == EINTR)
+        continue;
+      if (m < 0 && !kernel_refused(errno))
+        return -1;
+      if (m <= 0)
+      {
+        splice_file = 0;
+        break;
+      }
+      n -= m;
+    }
+    if (n > 0 && rw_copy(in, -1, files, nfiles, n) < 0)
+      return -1;
+  }
+}
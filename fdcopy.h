@@ -0,0 +1,17 @@
+#ifndef FDCOPY_H
+#define FDCOPY_H
+
+#include <stddef.h>
+
+// Copy everything from in to out until EOF. Data is moved inside the kernel
+// (copy_file_range between regular files, splice when either end is a pipe)
+// and falls back to read/write when the kernel refuses the pair.
+// Returns 0, or -1 with errno set (EPIPE when out's reader has gone away)
+int fd_copy(int in, int out);
+
+// Copy in to out and to each of the nfiles descriptors in files until EOF.
+// Pipe-to-pipe data is duplicated with tee(2) and spliced into a single
+// file; other combinations use read/write. Returns 0, or -1 with errno set
+int fd_tee(int in, int out, const int *files, size_t nfiles);
+
+#endif // FDCOPY_H
@@ -2,23 +2,141 @@
 #include <string.h>
 #include <stdio.h>
 #include "hash_map.h"
+#include "utils.h"
 
 /**
- * @Brief djb2 hash function by Dan Bernstein
- * @Ref https://theartincode.stanis.me/008-djb2/
+ * @Brief 64-bit string hash, eight bytes per step
+ *
+ * Mixes the key a word at a time with a multiply/rotate round and finishes
+ * with the murmur3 fmix64 avalanche, so both the low bits (used for the slot
+ * index) and the full value (cached in each Entry) are well distributed.
  *
  * @param key The string to hash
  * @return The hash value
  */
-unsigned int hash(const char *key)
+static uint64_t hash_key(const char *key)
+{
+  const uint64_t k = 0x9e3779b97f4a7c15ULL;
+  size_t len = strlen(key);
+  uint64_t h = k ^ len;
+
+  while (len >= 8)
+  {
+    uint64_t w;
+    memcpy(&w, key, 8);
+    w *= k;
+    w ^= w >> 29;
+    h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+    h = (h << 27) | (h >> 37);
+    key += 8;
+    len -= 8;
+  }
+  if (len > 0)
+  {
+    uint64_t w = 0;
+    memcpy(&w, key, len);
+    w *= k;
+    w ^= w >> 29;
+    h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* The hash behind slot indexes, e.g. for building colliding key sets */
+uint64_t hm_hash(const char *key)
+{
+  return hash_key(key);
+}
+
+/* Allocate a zeroed slot array */
+static Slot *alloc_slots(size_t capacity)
+{
+  Slot *slots = calloc(capacity, sizeof(Slot));
+  if (!slots)
+  {
+    perror("calloc");
+    exit(-1);
+  }
+  return slots;
+}
+
+/*
+ * Index of the slot holding key, or of the empty slot where it would be
+ * inserted. The table is never full, so the probe always terminates.
+ */
+static size_t find_slot(const HashMap *hm, const char *key, uint64_t h)
+{
+  size_t mask = hm->capacity - 1;
+  size_t i = (size_t)h & mask;
+  while (hm->slots[i].entry)
+  {
+    if (hm->slots[i].hash == h && strcmp(hm->slots[i].entry->key, key) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/* Double the capacity, moving entries by their cached hash */
+static void grow(HashMap *hm)
+{
+  size_t new_capacity = hm->capacity * 2;
+  size_t mask = new_capacity - 1;
+  Slot *new_slots = alloc_slots(new_capacity);
+
+  for (size_t i = 0; i < hm->capacity; i++)
+  {
+    Slot *s = &hm->slots[i];
+    if (!s->entry)
+      continue;
+    size_t j = (size_t)s->hash & mask;
+    while (new_slots[j].entry)
+      j = (j + 1) & mask;
+    new_slots[j] = *s;
+  }
+
+  free(hm->slots);
+  hm->slots = new_slots;
+  hm->capacity = new_capacity;
+}
+
+/* Level for a new skip list node: 1 + geometric(1/4), capped */
+static int random_level(HashMap *hm)
+{
+  uint64_t x = hm->rng;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  hm->rng = x;
+
+  int level = 1;
+  while ((x & 3) == 0 && level < HM_MAX_LEVEL)
+  {
+    level++;
+    x >>= 2;
+  }
+  return level;
+}
+
+/*
+ * Walk the skip list towards key. update[l] is set to the link at level l
+ * that points at the first entry whose key is >= key.
+ */
+static void order_seek(Entry **head, const char *key, Entry ***update)
 {
-  unsigned long h = 5381;
-  int c;
-  while ((c = *key++))
+  Entry **links = head;
+  for (int l = HM_MAX_LEVEL - 1; l >= 0; l--)
   {
-    h = ((h << 5) + h) + c; // h * 33 + c
+    while (links[l] && strcmp(links[l]->key, key) < 0)
+      links = links[l]->next;
+    update[l] = &links[l];
   }
-  return h % TABLE_SIZE;
 }
 
 /**
@@ -34,44 +152,70 @@ HashMap *hm_create(void)
     perror("malloc");
     exit(-1);
   };
-  for (int i = 0; i < TABLE_SIZE; i++)
+  ht->slots = alloc_slots(HM_INIT_CAPACITY);
+  ht->capacity = HM_INIT_CAPACITY;
+  ht->size = 0;
+  for (int l = 0; l < HM_MAX_LEVEL; l++)
   {
-    ht->buckets[i] = NULL;
+    ht->order[l] = NULL;
   }
+  ht->rng = 0x2545f4914f6cdd1dULL;
   return ht;
 }
 
 /**
  * @Brief Insert or update key-value pair
  *
+ * New keys are linked into the ordered index in O(log n).
+ *
  * @param hm Pointer to the HashMap
  * @param key The key string
  * @param value The value string
  */
 void hm_put(HashMap *hm, const char *key, const char *value)
 {
-  unsigned int idx = hash(key);
-  Entry *e = hm->buckets[idx];
-  
+  uint64_t h = hash_key(key);
+  size_t idx = find_slot(hm, key, h);
+
   // Check if key already exists
-  while (e)
+  if (hm->slots[idx].entry)
   {
-    if (strcmp(e->key, key) == 0)
-    {
-      // Update value
-      free(e->value);
-      e->value = strdup(value);
-      return;
-    }
-    e = e->next;
+    // Update value
+    Entry *e = hm->slots[idx].entry;
+    char *new_value = strdup(value);
+    free(e->value);
+    e->value = new_value;
+    return;
   }
 
-  // Insert new entry at head of list
-  Entry *new_entry = malloc(sizeof(Entry));
+  if ((hm->size + 1) * HM_MAX_LOAD_DEN > hm->capacity * HM_MAX_LOAD_NUM)
+  {
+    grow(hm);
+    idx = find_slot(hm, key, h);
+  }
+
+  int level = random_level(hm);
+  Entry *new_entry = malloc(sizeof(Entry) + level * sizeof(Entry *));
+  if (!new_entry)
+  {
+    perror("malloc");
+    exit(-1);
+  }
   new_entry->key = strdup(key);
   new_entry->value = strdup(value);
-  new_entry->next = hm->buckets[idx];
-  hm->buckets[idx] = new_entry;
+  new_entry->level = level;
+
+  Entry **update[HM_MAX_LEVEL];
+  order_seek(hm->order, key, update);
+  for (int l = 0; l < level; l++)
+  {
+    new_entry->next[l] = *update[l];
+    *update[l] = new_entry;
+  }
+
+  hm->slots[idx].hash = h;
+  hm->slots[idx].entry = new_entry;
+  hm->size++;
 }
 
 /**
@@ -82,123 +226,118 @@ void hm_put(HashMap *hm, const char *key, const char *value)
  */
 char *hm_get(const HashMap *hm, const char *key)
 {
-  const unsigned int idx = hash(key);
-  const Entry *e = hm->buckets[idx];
-  while (e)
-  {
-    if (strcmp(e->key, key) == 0)
-    {
-      return e->value;
-    }
-    e = e->next;
-  }
-  return NULL;
+  const Entry *e = hm->slots[find_slot(hm, key, hash_key(key))].entry;
+  return e ? e->value : NULL;
 }
 
-/* Delete the entry with a given key from the hashmap */
+/*
+ * Delete the entry with a given key from the hashmap. Later members of the
+ * probe run are shifted back into the hole, so no tombstones are needed.
+ */
 void hm_delete(HashMap *hm, const char *key)
 {
-  const unsigned int idx = hash(key);
-  Entry *e = hm->buckets[idx];
-  Entry *prev = NULL;
+  size_t mask = hm->capacity - 1;
+  size_t i = find_slot(hm, key, hash_key(key));
+  Entry *e = hm->slots[i].entry;
+  if (!e)
+    return;
 
-  while (e)
+  Entry **update[HM_MAX_LEVEL];
+  order_seek(hm->order, key, update);
+  for (int l = 0; l < e->level; l++)
   {
-    if (strcmp(e->key, key) == 0)
+    if (*update[l] == e)
+      *update[l] = e->next[l];
+  }
+  free(e->key);
+  free(e->value);
+  free(e);
+  hm->size--;
+
+  size_t j = i;
+  while (1)
+  {
+    j = (j + 1) & mask;
+    if (!hm->slots[j].entry)
+      break;
+    size_t home = (size_t)hm->slots[j].hash & mask;
+    // Move j into the hole at i unless its home lies cyclically in (i, j]
+    int stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+    if (!stays)
     {
-      if (prev)
-      {
-        prev->next = e->next;
-      }
-      else
-      {
-        hm->buckets[idx] = e->next;
-      }
-      free(e->key);
-      free(e->value);
-      free(e);
-      return;
+      hm->slots[i] = hm->slots[j];
+      i = j;
     }
-    prev = e;
-    e = e->next;
   }
+  hm->slots[i].entry = NULL;
 }
 
 /* Print the entries in the hashmap, one in each line */
 void hm_print(const HashMap *hm)
 {
-  for (int i = 0; i < TABLE_SIZE; i++)
+  for (size_t i = 0; i < hm->capacity; i++)
   {
-    const Entry *e = hm->buckets[i];
-    while (e)
-    {
-      printf("%s = '%s'\n",e->key, e->value);
-      e = e->next;
-    }
+    const Entry *e = hm->slots[i].entry;
+    if (e)
+      printf("%s = '%s'\n", e->key, e->value);
   }
 }
 
 /* Print the entries in the hashmap sorted by key */
-int cmp_keys(const void *a, const void *b) {
-  const char *ka = *(const char **)a;
-  const char *kb = *(const char **)b;
-  return strcmp(ka, kb);
+void hm_print_sorted(const HashMap *hm)
+{
+  hm_print_prefix(hm, "");
 }
 
-void hm_print_sorted(const HashMap *hm)
+/*
+ * Print the entries whose key starts with prefix, in key order. Seeks to the
+ * first candidate in O(log n) and then streams the range.
+ */
+void hm_print_prefix(const HashMap *hm, const char *prefix)
 {
-  // Count total entries
-  int count = 0;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    Entry *e = hm->buckets[i];
-    while (e) {
-      count++;
-      e = e->next;
-    }
-  }
-  if (count == 0) return;
-  // Collect keys
-  char **keys = malloc(count * sizeof(char *));
-  int idx = 0;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    Entry *e = hm->buckets[i];
-    while (e) {
-      keys[idx++] = e->key;
-      e = e->next;
-    }
-  }
-  // Sort keys
-  qsort(keys, count, sizeof(char *), cmp_keys);
-  // Print key-value pairs
-  for (int i = 0; i < count; i++) {
-    char *val = hm_get(hm, keys[i]);
-    printf("%s = '%s'\n", keys[i], val);
+  Entry **update[HM_MAX_LEVEL];
+  order_seek((Entry **)hm->order, prefix, update);
+
+  size_t plen = strlen(prefix);
+  StrBuf out = {NULL, 0, 0};
+  for (const Entry *e = *update[0]; e; e = e->next[0])
+  {
+    if (strncmp(e->key, prefix, plen) != 0)
+      break;
+    sb_puts(&out, e->key);
+    sb_add(&out, " = '", 4);
+    sb_puts(&out, e->value);
+    sb_add(&out, "'\n", 2);
   }
-  free(keys);
+  sb_flush_stdout(&out);
+  sb_free(&out);
 }
 
-/* Reinitialize the hashmap */
+/* Remove every entry in place; the slot array is kept for reuse */
 void hm_reset(HashMap *hm)
 {
-  hm_free(hm);
-  hm = hm_create();
+  Entry *e = hm->order[0];
+  while (e)
+  {
+    Entry *next = e->next[0];
+    free(e->key);
+    free(e->value);
+    free(e);
+    e = next;
+  }
+  memset(hm->slots, 0, hm->capacity * sizeof(Slot));
+  for (int l = 0; l < HM_MAX_LEVEL; l++)
+  {
+    hm->order[l] = NULL;
+  }
+  hm->size = 0;
 }
 
 /* Free the memory used by the hashmap */
 void hm_free(HashMap *hm)
 {
-  for (int i = 0; i < TABLE_SIZE; i++)
-  {
-    Entry *e = hm->buckets[i];
-    while (e)
-    {
-      Entry *next = e->next;
-      free(e->key);
-      free(e->value);
-      free(e);
-      e = next;
-    }
-  }
+  hm_reset(hm);
+  free(hm->slots);
   free(hm);
 }
 
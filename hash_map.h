@@ -1,18 +1,35 @@
 #ifndef HASH_MAP_H
 #define HASH_MAP_H
 
-#define TABLE_SIZE 101  // prime number for better hashing
+#include <stddef.h>
+#include <stdint.h>
 
-// Entry in the key-value store
+#define HM_INIT_CAPACITY 16  // power of two, grows by doubling
+#define HM_MAX_LOAD_NUM 3    // resize once size exceeds 3/4 of capacity
+#define HM_MAX_LOAD_DEN 4
+#define HM_MAX_LEVEL 16      // skip list height, plenty for 4^16 keys
+
+// Entry in the key-value store, also a node of the key-ordered skip list
 typedef struct Entry{
     char *key;
     char *value;
-    struct Entry *next;  // for chaining
+    int level;             // number of forward links
+    struct Entry *next[];  // next entry in key order at each level
 } Entry;
 
-// Hash table
+// Hash slot (entry == NULL marks an empty slot)
+typedef struct {
+    uint64_t hash;  // full hash of entry->key, so lookups and resizes never rehash
+    Entry *entry;
+} Slot;
+
+// Hash table (open addressing, linear probing) with an ordered index
 typedef struct {
-    Entry *buckets[TABLE_SIZE];
+    Slot *slots;
+    size_t capacity;  // number of slots, always a power of two
+    size_t size;      // number of entries
+    Entry *order[HM_MAX_LEVEL];  // skip list heads, keys in strcmp order
+    uint64_t rng;     // state for picking skip list levels
 } HashMap;
 
 // Create a new HashMap
@@ -33,10 +50,16 @@ void hm_print(const HashMap *hm);
 // Print the Key Value pairs in sorted order by Key
 void hm_print_sorted(const HashMap *hm);
 
-// Reset HashMap
+// Print, in sorted order, the Key Value pairs whose Key starts with prefix
+void hm_print_prefix(const HashMap *hm, const char *prefix);
+
+// Remove every entry, keeping the HashMap usable
 void hm_reset(HashMap *hm);
 
 // Free whole HashMap
 void hm_free(HashMap *hm);
 
+// Hash of key; its low bits pick the home slot
+uint64_t hm_hash(const char *key);
+
 #endif // HASH_MAP_H
@@ -0,0 +1,529 @@
+#define _GNU_SOURCE /* memrchr */
+#include "history.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HIST_TEXT_INIT 4096 // initial arena bytes; the arena doubles as entries need
+#define HIST_RING_INIT 64   // initial entry slots; doubled up to the capacity
+
+static void *xmalloc(size_t n)
+{
+  void *p = malloc(n);
+  if (!p)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+  return p;
+}
+
+static void *xrealloc(void *old, size_t n)
+{
+  void *p = realloc(old, n);
+  if (!p)
+  {
+    perror("realloc");
+    exit(-1);
+  }
+  return p;
+}
+
+/* Offset of the entry at ring position i (0 = oldest) */
+static size_t entry_offset(const History *h, size_t i)
+{
+  return h->offsets[(h->first + i) % h->ring_cap];
+}
+
+/* Double the ring (up to capacity), unwrapping it so the oldest entry is at slot 0 */
+static void grow_ring(History *h)
+{
+  size_t new_cap = h->ring_cap * 2 < h->capacity ? h->ring_cap * 2 : h->capacity;
+  size_t *offsets = xmalloc(new_cap * sizeof(size_t));
+  for (size_t i = 0; i < h->count; i++)
+    offsets[i] = entry_offset(h, i);
+  free(h->offsets);
+  h->offsets = offsets;
+  h->ring_cap = new_cap;
+  h->first = 0;
+}
+
+/* Drop the oldest entry in O(1) */
+static void evict_oldest(History *h)
+{
+  size_t off = entry_offset(h, 0);
+  h->text_live -= strlen(h->text + off) + 1;
+  h->first = (h->first + 1) % h->ring_cap;
+  h->count--;
+}
+
+/* Reallocate the arena to new_cap bytes, packing live entries from offset 0 */
+static void resize_text(History *h, size_t new_cap)
+{
+  char *text = xmalloc(new_cap);
+  size_t pos = 0;
+  for (size_t i = 0; i < h->count; i++)
+  {
+    size_t slot = (h->first + i) % h->ring_cap;
+    size_t n = strlen(h->text + h->offsets[slot]) + 1;
+    memcpy(text + pos, h->text + h->offsets[slot], n);
+    h->offsets[slot] = pos;
+    pos += n;
+  }
+  free(h->text);
+  h->text = text;
+  h->text_cap = new_cap;
+  h->text_tail = pos;
+}
+
+/**
+ * @Brief Create a new History
+ *
+ * Nothing is sized by capacity up front: the entry ring, the arena and the
+ * index of file lines grow as entries arrive, so a large HISTSIZE costs
+ * only what is actually kept.
+ *
+ * @param capacity Maximum number of entries to keep
+ * @return Pointer to a newly created History
+ */
+History *hist_create(size_t capacity)
+{
+  History *h = xmalloc(sizeof(History));
+  h->capacity = capacity;
+  h->ring_cap = capacity < HIST_RING_INIT ? capacity : HIST_RING_INIT;
+  h->offsets = h->ring_cap ? xmalloc(h->ring_cap * sizeof(size_t)) : NULL;
+  h->text_cap = HIST_TEXT_INIT;
+  h->text = xmalloc(h->text_cap);
+  h->text_tail = 0;
+  h->text_live = 0;
+  h->first = 0;
+  h->count = 0;
+  h->added = 0;
+  h->map = NULL;
+  h->map_len = 0;
+  h->map_scanned = 0;
+  h->map_lines = NULL;
+  h->map_nlines = 0;
+  h->map_lines_cap = 0;
+  h->fd = -1;
+  memset(&h->index, 0, sizeof(h->index));
+  return h;
+}
+
+/**
+ * @Brief Use path as the persistent history file
+ *
+ * The current contents are mapped privately and only split into lines when
+ * an entry is first asked for, so startup cost does not depend on the size
+ * of the file. Entries added afterwards are appended to it, one write each;
+ * O_APPEND keeps lines from concurrent shells from interleaving.
+ *
+ * @param h Pointer to the History
+ * @param path History file, created if missing
+ * @return 0 on success, -1 if the file cannot be opened for appending
+ */
+int hist_attach_file(History *h, const char *path)
+{
+  if (h->capacity == 0)
+    return 0;
+
+  int rfd = open(path, O_RDONLY | O_CLOEXEC);
+  if (rfd >= 0)
+  {
+    struct stat st;
+    if (fstat(rfd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+      void *m = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, rfd, 0);
+      if (m != MAP_FAILED)
+      {
+        h->map = m;
+        h->map_len = (size_t)st.st_size;
+        /* A trailing line without its newline is still being written elsewhere */
+        h->map_scanned = 0;
+        while (h->map_scanned < h->map_len && h->map[h->map_len - h->map_scanned - 1] != '\n')
+          h->map_scanned++;
+      }
+    }
+    close(rfd);
+  }
+
+  h->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  return h->fd >= 0 ? 0 : -1;
+}
+
+/*
+ * Number of file lines visible in front of the session entries: together
+ * with everything added this session they make up the newest capacity
+ * entries, so the number only ever shrinks. File lines are split off the end
+ * of the mapping (newline overwritten by NUL) only as far as that requires.
+ */
+static size_t map_visible(History *h)
+{
+  if (!h->map || h->added >= h->capacity)
+    return 0;
+  size_t want = h->capacity - h->added;
+  while (h->map_nlines < want && h->map_scanned < h->map_len)
+  {
+    size_t end = h->map_len - h->map_scanned - 1; /* offset of a '\n' */
+    const char *nl = end > 0 ? memrchr(h->map, '\n', end) : NULL;
+    size_t start = nl ? (size_t)(nl - h->map) + 1 : 0;
+    h->map[end] = '\0';
+    h->map_scanned = h->map_len - start;
+    if (end > start)
+    {
+      if (h->map_nlines == h->map_lines_cap)
+      {
+        h->map_lines_cap = h->map_lines_cap ? h->map_lines_cap * 2 : HIST_RING_INIT;
+        h->map_lines = xrealloc(h->map_lines, h->map_lines_cap * sizeof(size_t));
+      }
+      h->map_lines[h->map_nlines++] = start;
+    }
+  }
+  return h->map_nlines < want ? h->map_nlines : want;
+}
+
+/*
+ * Search index. Every entry gets an id that increases with its position in
+ * history: the k-th newest file line is capacity - 1 - k and the n-th entry
+ * added this session is capacity + n. Each trigram of "\1" + line (the \1
+ * gives prefixes trigrams of their own) maps to the ascending ids of the
+ * entries containing it; evicted ids are trimmed from the front lazily.
+ */
+#define INDEX_BOS '\1'
+
+static uint32_t trigram(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+/* Slot for key in the trigram table (empty slot if absent) */
+static Posting *index_slot(const TrigramIndex *ix, uint32_t key)
+{
+  size_t mask = ix->capacity - 1;
+  size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+  while (ix->slots[i].key && ix->slots[i].key != key)
+    i = (i + 1) & mask;
+  return &ix->slots[i];
+}
+
+static void index_grow(TrigramIndex *ix)
+{
+  Posting *old = ix->slots;
+  size_t old_capacity = ix->capacity;
+  ix->capacity = old_capacity ? old_capacity * 2 : 1024;
+  ix->slots = calloc(ix->capacity, sizeof(Posting));
+  if (!ix->slots)
+  {
+    perror("calloc");
+    exit(-1);
+  }
+  for (size_t i = 0; i < old_capacity; i++)
+  {
+    if (old[i].key)
+      *index_slot(ix, old[i].key) = old[i];
+  }
+  free(old);
+}
+
+/* Lowest id still visible; ids below it belong to evicted entries */
+static size_t lowest_id(History *h)
+{
+  size_t from_file = map_visible(h);
+  if (from_file > 0)
+    return h->capacity - from_file;
+  return h->capacity + h->added - h->count;
+}
+
+/* Drop the evicted ids at the front of p, compacting once half is dead */
+static void posting_trim(Posting *p, size_t low)
+{
+  while (p->start < p->len && p->ids[p->start] < low)
+    p->start++;
+  if (p->start > 0 && p->start * 2 >= p->len)
+  {
+    memmove(p->ids, p->ids + p->start, (p->len - p->start) * sizeof(size_t));
+    p->len -= p->start;
+    p->start = 0;
+  }
+}
+
+/* Record id under every trigram of line */
+static void index_add(History *h, const char *line, size_t id)
+{
+  TrigramIndex *ix = &h->index;
+  size_t low = lowest_id(h);
+  size_t len = strlen(line);
+
+  /* Trigram i covers bytes i..i+2 of "\1" + line */
+  for (size_t i = 0; i + 1 < len; i++)
+  {
+    unsigned char t[3];
+    t[0] = i == 0 ? INDEX_BOS : (unsigned char)line[i - 1];
+    t[1] = (unsigned char)line[i];
+    t[2] = (unsigned char)line[i + 1];
+
+    if ((ix->size + 1) * 4 > ix->capacity * 3)
+      index_grow(ix);
+    Posting *p = index_slot(ix, trigram(t));
+    if (!p->key)
+    {
+      p->key = trigram(t);
+      ix->size++;
+    }
+    if (p->len > p->start && p->ids[p->len - 1] == id)
+      continue; /* trigram repeats within the line */
+    posting_trim(p, low);
+    if (p->len == p->cap)
+    {
+      p->cap = p->cap ? p->cap * 2 : 4;
+      size_t *tmp = realloc(p->ids, p->cap * sizeof(size_t));
+      if (!tmp)
+      {
+        perror("realloc");
+        exit(-1);
+      }
+      p->ids = tmp;
+    }
+    p->ids[p->len++] = id;
+  }
+
+  /* Postings that are never appended to again still shed their dead ids */
+  if (h->added >= ix->next_sweep)
+  {
+    for (size_t i = 0; i < ix->capacity; i++)
+    {
+      Posting *p = &ix->slots[i];
+      if (!p->key)
+        continue;
+      posting_trim(p, low);
+      if (p->start == p->len)
+      {
+        free(p->ids);
+        p->ids = NULL;
+        p->start = p->len = p->cap = 0;
+      }
+    }
+    ix->next_sweep = h->added + h->capacity;
+  }
+}
+
+/* Build the index over everything currently visible */
+static void index_build(History *h)
+{
+  index_grow(&h->index);
+  h->index.next_sweep = h->added + h->capacity;
+
+  size_t from_file = map_visible(h);
+  for (size_t k = from_file; k-- > 0;)
+    index_add(h, h->map + h->map_lines[k], h->capacity - 1 - k);
+  for (size_t i = 0; i < h->count; i++)
+    index_add(h, h->text + entry_offset(h, i), h->capacity + h->added - h->count + i);
+}
+
+/**
+ * @Brief Append an entry
+ *
+ * The entry is copied to the arena tail, wrapping to the start of the arena
+ * when it does not fit before the end. The oldest entry is evicted once
+ * capacity is reached, as are any whose bytes would be overwritten. The
+ * arena doubles when live text would exceed half of it, so its size is
+ * bounded by the longest capacity entries rather than by the session.
+ *
+ * @param h Pointer to the History
+ * @param line Text of the entry (need not be NUL-terminated)
+ * @param len Number of bytes of line to store
+ */
+void hist_add(History *h, const char *line, size_t len)
+{
+  if (h->capacity == 0)
+    return;
+
+  size_t need = len + 1;
+  if (h->count == h->capacity)
+    evict_oldest(h);
+
+  if (2 * (h->text_live + need) > h->text_cap)
+  {
+    size_t new_cap = h->text_cap * 2;
+    while (2 * (h->text_live + need) > new_cap)
+      new_cap *= 2;
+    resize_text(h, new_cap);
+  }
+
+  size_t w = h->text_tail;
+  if (w + need > h->text_cap)
+  {
+    // Entries between the tail and the end of the arena would be skipped over
+    while (h->count > 0 && entry_offset(h, 0) >= w)
+      evict_oldest(h);
+    w = 0;
+  }
+  while (h->count > 0)
+  {
+    size_t off = entry_offset(h, 0);
+    size_t end = off + strlen(h->text + off) + 1;
+    if (off >= w + need || end <= w)
+      break;
+    evict_oldest(h);
+  }
+
+  memcpy(h->text + w, line, len);
+  if (h->fd >= 0)
+  {
+    h->text[w + len] = '\n';
+    ssize_t n;
+    do
+      n = write(h->fd, h->text + w, need);
+    while (n < 0 && errno == EINTR);
+  }
+  h->text[w + len] = '\0';
+  if (h->count == h->ring_cap)
+    grow_ring(h);
+  h->offsets[(h->first + h->count) % h->ring_cap] = w;
+  h->count++;
+  h->added++;
+  h->text_live += need;
+  h->text_tail = w + need;
+
+  if (h->index.capacity)
+    index_add(h, h->text + w, h->capacity + h->added - 1);
+}
+
+/* Get entry at an index, 0 being the oldest (NULL if not found) */
+const char *hist_get(History *h, size_t ind)
+{
+  size_t from_file = map_visible(h);
+  if (ind < from_file)
+    return h->map + h->map_lines[from_file - 1 - ind];
+  ind -= from_file;
+  if (ind >= h->count)
+    return NULL;
+  return h->text + entry_offset(h, ind);
+}
+
+/* Number of entries currently kept */
+size_t hist_count(History *h)
+{
+  return map_visible(h) + h->count;
+}
+
+/* Position of the entry with this id in hist_get order, or -1 if evicted */
+static long id_to_index(History *h, size_t id)
+{
+  size_t from_file = map_visible(h);
+  if (id < h->capacity)
+  {
+    size_t k = h->capacity - 1 - id;
+    return k < from_file ? (long)(from_file - 1 - k) : -1;
+  }
+  size_t seq = id - h->capacity;
+  size_t first_seq = h->added - h->count;
+  return seq >= first_seq ? (long)(from_file + seq - first_seq) : -1;
+}
+
+static int entry_matches(const char *line, const char *pat, size_t pat_len, int prefix)
+{
+  return prefix ? strncmp(line, pat, pat_len) == 0 : strstr(line, pat) != NULL;
+}
+
+/**
+ * @Brief Find entries containing (or starting with) a pattern
+ *
+ * Patterns with a trigram (3+ bytes, or 2+ for prefixes) only look at the
+ * entries listed under their rarest trigram; shorter ones fall back to a
+ * scan. Candidates are confirmed with strstr/strncmp.
+ *
+ * @param h Pointer to the History
+ * @param pat Substring or prefix to look for
+ * @param prefix Nonzero to match only at the start of entries
+ * @param out Set to a malloc'ed array of hist_get indexes, oldest first
+ * @return Number of matches
+ */
+size_t hist_search(History *h, const char *pat, int prefix, size_t **out)
+{
+  size_t total = hist_count(h);
+  size_t pat_len = strlen(pat);
+  size_t n = 0;
+  *out = NULL;
+  if (total == 0)
+    return 0;
+
+  /* Trigrams of the pattern: of "\1" + pat for a prefix, of pat otherwise */
+  size_t ntri = prefix ? (pat_len >= 2 ? pat_len - 1 : 0) : (pat_len >= 3 ? pat_len - 2 : 0);
+  if (ntri == 0)
+  {
+    size_t *res = xmalloc(total * sizeof(size_t));
+    for (size_t i = 0; i < total; i++)
+    {
+      if (entry_matches(hist_get(h, i), pat, pat_len, prefix))
+        res[n++] = i;
+    }
+    *out = res;
+    return n;
+  }
+
+  if (!h->index.capacity)
+    index_build(h);
+
+  size_t low = lowest_id(h);
+  const Posting *best = NULL;
+  for (size_t i = 0; i < ntri; i++)
+  {
+    unsigned char t[3];
+    if (prefix)
+    {
+      t[0] = i == 0 ? INDEX_BOS : (unsigned char)pat[i - 1];
+      t[1] = (unsigned char)pat[i];
+      t[2] = (unsigned char)pat[i + 1];
+    }
+    else
+    {
+      memcpy(t, pat + i, 3);
+    }
+    Posting *p = index_slot(&h->index, trigram(t));
+    if (!p->key)
+    {
+      best = NULL;
+      break;
+    }
+    posting_trim(p, low);
+    if (!best || p->len - p->start < best->len - best->start)
+      best = p;
+    if (best->len == best->start)
+      break;
+  }
+
+  /* Matches are a subset of the rarest trigram's entries, so that bounds the result */
+  if (!best || best->len == best->start)
+    return 0;
+  size_t *res = xmalloc((best->len - best->start) * sizeof(size_t));
+  for (size_t j = best->start; j < best->len; j++)
+  {
+    long idx = id_to_index(h, best->ids[j]);
+    if (idx >= 0 && entry_matches(hist_get(h, (size_t)idx), pat, pat_len, prefix))
+      res[n++] = (size_t)idx;
+  }
+  *out = res;
+  return n;
+}
+
+/* Free whole History */
+void hist_free(History *h)
+{
+  if (h->map)
+    munmap(h->map, h->map_len);
+  if (h->fd >= 0)
+    close(h->fd);
+  for (size_t i = 0; i < h->index.capacity; i++)
+    free(h->index.slots[i].ids);
+  free(h->index.slots);
+  free(h->map_lines);
+  free(h->offsets);
+  free(h->text);
+  free(h);
+}
@@ -0,0 +1,71 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Ids of the entries containing one trigram, ascending (live ids are ids[start..len))
+typedef struct {
+    uint32_t key;  // Packed trigram, 0 marks an empty slot
+    size_t *ids;
+    size_t start;
+    size_t len;
+    size_t cap;
+} Posting;
+
+// Trigram -> Posting table (open addressing), built on the first search
+typedef struct {
+    Posting *slots;
+    size_t capacity;    // Power of two, 0 until built
+    size_t size;
+    size_t next_sweep;  // Value of History.added at which stale ids are trimmed everywhere
+} TrigramIndex;
+
+// Bounded history: a ring of entries whose text lives in one circular byte
+// arena, optionally preceded by the lines of a memory-mapped history file
+typedef struct {
+    char *text;        // Arena holding NUL-terminated entries back to back
+    size_t text_cap;   // Size of text
+    size_t text_tail;  // Offset where the next entry is written
+    size_t text_live;  // Bytes used by live entries (including NULs)
+    size_t *offsets;   // Ring of entry offsets into text, oldest at first
+    size_t ring_cap;   // Slots in offsets, doubled on demand up to capacity
+    size_t capacity;   // Max number of entries kept (HISTSIZE)
+    size_t first;      // Ring index of the oldest entry
+    size_t count;      // Number of live entries
+    size_t added;      // Entries ever added this session
+
+    char *map;          // Private mapping of the history file as it was at attach time
+    size_t map_len;     // Length of map
+    size_t map_scanned; // Bytes at the end of map already split into lines
+    size_t *map_lines;  // Offsets of indexed file lines, newest first
+    size_t map_nlines;  // Number of indexed file lines
+    size_t map_lines_cap; // Slots in map_lines, grown on demand
+    int fd;             // History file opened O_APPEND, -1 if not persisting
+
+    TrigramIndex index; // Search index, maintained on add once built
+} History;
+
+// Create a History keeping at most capacity entries (0 keeps nothing)
+History *hist_create(size_t capacity);
+
+// Append the first len bytes of line, evicting the oldest entries if needed
+void hist_add(History *h, const char *line, size_t len);
+
+// Load the history file at path (mapped, indexed on demand) and append new entries to it
+int hist_attach_file(History *h, const char *path);
+
+// Get entry at an index, 0 being the oldest (NULL if not found)
+const char *hist_get(History *h, size_t ind);
+
+// Number of entries currently kept
+size_t hist_count(History *h);
+
+// Find entries containing pat (starting with it if prefix), oldest first.
+// Stores malloc'ed indexes usable with hist_get in *out and returns how many
+size_t hist_search(History *h, const char *pat, int prefix, size_t **out);
+
+// Free whole History
+void hist_free(History *h);
+
+#endif // HISTORY_H
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dynamic_array.h"
+#include "hash_map.h"
+#include "history.h"
+#include "utils.h"
+#include "wsh.h"
+#include "microbench.h"
+
+/*
+ * Allocation counting: these replace the libc allocator for the whole
+ * process (glibc routes its own internal calls, strdup included, through
+ * them) and forward to the real implementation.
+ */
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t count, size_t n);
+extern void *__libc_realloc(void *p, size_t n);
+extern void __libc_free(void *p);
+
+static size_t alloc_calls;
+static size_t alloc_bytes;
+
+void *malloc(size_t n)
+{
+  alloc_calls++;
+  alloc_bytes += n;
+  return __libc_malloc(n);
+}
+
+void *calloc(size_t count, size_t n)
+{
+  alloc_calls++;
+  alloc_bytes += count * n;
+  return __libc_calloc(count, n);
+}
+
+void *realloc(void *p, size_t n)
+{
+  alloc_calls++;
+  alloc_bytes += n;
+  return __libc_realloc(p, n);
+}
+
+void free(void *p)
+{
+  __libc_free(p);
+}
+
+/* Measurement of the current run, filled by mb_begin/mb_end */
+static struct {
+  double start_ns, ns;
+  size_t start_calls, calls;
+  size_t start_bytes, bytes;
+} cur;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void mb_begin(void)
+{
+  cur.start_calls = alloc_calls;
+  cur.start_bytes = alloc_bytes;
+  cur.start_ns = now_ns();
+}
+
+static void mb_end(void)
+{
+  cur.ns = now_ns() - cur.start_ns;
+  cur.calls = alloc_calls - cur.start_calls;
+  cur.bytes = alloc_bytes - cur.start_bytes;
+}
+
+/* Keeps results alive so loops are not optimized away */
+static volatile uintptr_t sink;
+
+/* n distinct keys like the alias names a user defines */
+static char **make_keys(size_t n, const char *fmt)
+{
+  char **keys = malloc(n * sizeof(char *));
+  if (!keys)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+  for (size_t i = 0; i < n; i++)
+  {
+    char buf[512];
+    snprintf(buf, sizeof(buf), fmt, i);
+    keys[i] = strdup(buf);
+  }
+  return keys;
+}
+
+/* n keys whose hashes agree in the low MB_COLLIDE_BITS bits */
+static char **make_colliding_keys(size_t n)
+{
+  char **keys = malloc(n * sizeof(char *));
+  if (!keys)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+  uint64_t mask = (1u << MB_COLLIDE_BITS) - 1;
+  size_t found = 0;
+  for (size_t i = 0; found < n; i++)
+  {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "c%zu", i);
+    if ((hm_hash(buf) & mask) == 0)
+      keys[found++] = strdup(buf);
+  }
+  return keys;
+}
+
+static void free_keys(char **keys, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    free(keys[i]);
+  free(keys);
+}
+
+static size_t hm_fill(char **keys, size_t n)
+{
+  HashMap *hm = hm_create();
+  mb_begin();
+  for (size_t i = 0; i < n; i++)
+    hm_put(hm, keys[i], "value");
+  mb_end();
+  hm_free(hm);
+  return n;
+}
+
+static size_t hm_lookup(char **keys, char **probe, size_t n)
+{
+  HashMap *hm = hm_create();
+  for (size_t i = 0; i < n; i++)
+    hm_put(hm, keys[i], "value");
+  mb_begin();
+  for (size_t i = 0; i < n; i++)
+    sink += (uintptr_t)hm_get(hm, probe[i]);
+  mb_end();
+  hm_free(hm);
+  return n;
+}
+
+static size_t bench_hm_put(void)
+{
+  char **keys = make_keys(MB_ENTRIES, "alias%zu");
+  size_t ops = hm_fill(keys, MB_ENTRIES);
+  free_keys(keys, MB_ENTRIES);
+  return ops;
+}
+
+static size_t bench_hm_put_overwrite(void)
+{
+  char **keys = make_keys(MB_ENTRIES, "alias%zu");
+  HashMap *hm = hm_create();
+  for (size_t i = 0; i < MB_ENTRIES; i++)
+    hm_put(hm, keys[i], "old");
+  mb_begin();
+  for (size_t i = 0; i < MB_ENTRIES; i++)
+    hm_put(hm, keys[i], "new value");
+  mb_end();
+  hm_free(hm);
+  free_keys(keys, MB_ENTRIES);
+  return MB_ENTRIES;
+}
+
+static size_t bench_hm_get_hit(void)
+{
+  char **keys = make_keys(MB_ENTRIES, "alias%zu");
+  size_t ops = hm_lookup(keys, keys, MB_ENTRIES);
+  free_keys(keys, MB_ENTRIES);
+  return ops;
+}
+
+static size_t bench_hm_get_miss(void)
+{
+  char **keys = make_keys(MB_ENTRIES, "alias%zu");
+  char **miss = make_keys(MB_ENTRIES, "other%zu");
+  size_t ops = hm_lookup(keys, miss, MB_ENTRIES);
+  free_keys(keys, MB_ENTRIES);
+  free_keys(miss, MB_ENTRIES);
+  return ops;
+}
+
+static size_t bench_hm_put_colliding(void)
+{
+  char **keys = make_colliding_keys(MB_COLLIDING);
+  size_t ops = hm_fill(keys, MB_COLLIDING);
+  free_keys(keys, MB_COLLIDING);
+  return ops;
+}
+
+static size_t bench_hm_get_colliding(void)
+{
+  char **keys = make_colliding_keys(MB_COLLIDING);
+  size_t ops = hm_lookup(keys, keys, MB_COLLIDING);
+  free_keys(keys, MB_COLLIDING);
+  return ops;
+}
+
+/* Keys differing only after a 256-byte common prefix: every compare is long */
+static size_t bench_hm_put_long_prefix(void)
+{
+  char fmt[300];
+  memset(fmt, 'p', 256);
+  strcpy(fmt + 256, "%zu");
+  char **keys = make_keys(MB_ENTRIES / 10, fmt);
+  size_t ops = hm_fill(keys, MB_ENTRIES / 10);
+  free_keys(keys, MB_ENTRIES / 10);
+  return ops;
+}
+
+/* History-like command lines */
+static char **make_lines(size_t n)
+{
+  return make_keys(n, "git commit -m 'change number %zu' --no-verify");
+}
+
+static size_t bench_da_put(void)
+{
+  char **lines = make_lines(MB_ENTRIES);
+  DynamicArray *da = da_create(16);
+  mb_begin();
+  for (size_t i = 0; i < MB_ENTRIES; i++)
+    da_put(da, lines[i]);
+  mb_end();
+  da_free(da);
+  free_keys(lines, MB_ENTRIES);
+  return MB_ENTRIES;
+}
+
+static size_t bench_da_get(void)
+{
+  char **lines = make_lines(MB_ENTRIES);
+  DynamicArray *da = da_create(16);
+  for (size_t i = 0; i < MB_ENTRIES; i++)
+    da_put(da, lines[i]);
+  mb_begin();
+  for (size_t i = 0; i < MB_ENTRIES; i++)
+    sink += (uintptr_t)da_get(da, i);
+  mb_end();
+  da_free(da);
+  free_keys(lines, MB_ENTRIES);
+  return MB_ENTRIES;
+}
+
+/* Deleting at the front packs the whole array every time */
+static size_t bench_da_delete_front(void)
+{
+  size_t n = MB_ENTRIES / 10;
+  char **lines = make_lines(n);
+  DynamicArray *da = da_create(16);
+  for (size_t i = 0; i < n; i++)
+    da_put(da, lines[i]);
+  mb_begin();
+  for (size_t i = 0; i < n; i++)
+    da_delete(da, 0);
+  mb_end();
+  da_free(da);
+  free_keys(lines, n);
+  return n;
+}
+
+static size_t bench_hist_add(void)
+{
+  char **lines = make_lines(MB_ENTRIES);
+  History *h = hist_create(MB_ENTRIES / 10);
+  mb_begin();
+  for (size_t i = 0; i < MB_ENTRIES; i++)
+    hist_add(h, lines[i], strlen(lines[i]));
+  mb_end();
+  hist_free(h);
+  free_keys(lines, MB_ENTRIES);
+  return MB_ENTRIES;
+}
+
+static size_t bench_hist_search(void)
+{
+  char **lines = make_lines(MB_ENTRIES);
+  History *h = hist_create(MB_ENTRIES);
+  for (size_t i = 0; i < MB_ENTRIES; i++)
+    hist_add(h, lines[i], strlen(lines[i]));
+  size_t *ids = NULL;
+  hist_search(h, "warm", 0, &ids); /* builds the index */
+  free(ids);
+  const size_t n = 200;
+  mb_begin();
+  for (size_t i = 0; i < n; i++)
+  {
+    char pat[32];
+    snprintf(pat, sizeof(pat), "number %zu'", i * 397 % MB_ENTRIES);
+    sink += hist_search(h, pat, 0, &ids);
+    free(ids);
+  }
+  mb_end();
+  hist_free(h);
+  free_keys(lines, MB_ENTRIES);
+  return n;
+}
+
+/* Alias expansion: replace the first word of a command line */
+static size_t bench_replace_at(void)
+{
+  const char *line = "ll -a | grep -v '^d' | sort -k5 -n | tail -20";
+  const size_t n = MB_ENTRIES;
+  mb_begin();
+  for (size_t i = 0; i < n; i++)
+  {
+    char *s = replaceAt(line, 0, 2, "ls -l --color=auto");
+    sink += (uintptr_t)s[0];
+    free(s);
+  }
+  mb_end();
+  return n;
+}
+
+/* Growing one string by repeated append rescans it every time */
+static size_t bench_append_growth(void)
+{
+  const size_t n = MB_ENTRIES / 10;
+  char *s = NULL;
+  mb_begin();
+  for (size_t i = 0; i < n; i++)
+    s = append(s, "chunk-of-text-16");
+  mb_end();
+  free(s);
+  return n;
+}
+
+static size_t bench_sb_add_growth(void)
+{
+  const size_t n = MB_ENTRIES;
+  StrBuf sb = {0};
+  mb_begin();
+  for (size_t i = 0; i < n; i++)
+    sb_add(&sb, "chunk-of-text-16", 16);
+  mb_end();
+  sb_free(&sb);
+  return n;
+}
+
+/* Lines of 100 words, two thirds single-quoted (half of those with a space) */
+static void long_quoted_line(char *buf, size_t size)
+{
+  size_t len = 0;
+  len += snprintf(buf + len, size - len, "cmd");
+  for (int w = 1; w < 100; w++)
+  {
+    const char *fmt = w % 3 == 0 ? " word%d" : w % 3 == 1 ? " 'single %d'" : " 'q%d'";
+    len += snprintf(buf + len, size - len, fmt, w);
+  }
+}
+
+static size_t parse_no_subst(const char *line, size_t n)
+{
+  ArgVec av = {0};
+  mb_begin();
+  for (size_t i = 0; i < n; i++)
+  {
+    parseline_no_subst(line, &av);
+    sink += av.argc;
+    for (int a = 0; a < av.argc; a++)
+      free(av.argv[a]);
+  }
+  mb_end();
+  argvec_free(&av);
+  return n;
+}
+
+static size_t bench_parse_short(void)
+{
+  return parse_no_subst("ls -l /tmp | grep 'wsh bench' | wc -l", MB_ENTRIES);
+}
+
+static size_t bench_parse_long_quoted(void)
+{
+  char line[4096];
+  long_quoted_line(line, sizeof(line));
+  return parse_no_subst(line, MB_ENTRIES / 10);
+}
+
+/* In-place tokenizing into a reused ArgVec; the copy it needs is timed too */
+static size_t parse_inplace(const char *line, size_t n)
+{
+  size_t len = strlen(line) + 1;
+  char *buf = malloc(len);
+  if (!buf)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+  ArgVec av = {0};
+  mb_begin();
+  for (size_t i = 0; i < n; i++)
+  {
+    memcpy(buf, line, len);
+    parseline_inplace(buf, &av);
+    sink += av.argc;
+  }
+  mb_end();
+  argvec_free(&av);
+  free(buf);
+  return n;
+}
+
+static size_t bench_parse_inplace_long(void)
+{
+  char line[4096];
+  long_quoted_line(line, sizeof(line));
+  return parse_inplace(line, MB_ENTRIES / 10);
+}
+
+/* A generated-script line with MB_HUGE_WORDS arguments */
+static size_t bench_parse_inplace_huge(void)
+{
+  StrBuf sb = {0};
+  sb_puts(&sb, "cmd");
+  for (int w = 0; w < MB_HUGE_WORDS; w++)
+    sb_printf(&sb, w % 2 ? " 'arg %d'" : " arg%d", w);
+  sb_add(&sb, "", 1);
+  size_t ops = parse_inplace(sb.data, 100);
+  sb_free(&sb);
+  return ops;
+}
+
+static const MicroBench benches[] = {
+    {"hm_put", bench_hm_put},
+    {"hm_put_overwrite", bench_hm_put_overwrite},
+    {"hm_get_hit", bench_hm_get_hit},
+    {"hm_get_miss", bench_hm_get_miss},
+    {"hm_put_colliding", bench_hm_put_colliding},
+    {"hm_get_colliding", bench_hm_get_colliding},
+    {"hm_put_long_prefix", bench_hm_put_long_prefix},
+    {"da_put", bench_da_put},
+    {"da_get", bench_da_get},
+    {"da_delete_front", bench_da_delete_front},
+    {"hist_add", bench_hist_add},
+    {"hist_search", bench_hist_search},
+    {"replaceAt", bench_replace_at},
+    {"append_growth", bench_append_growth},
+    {"sb_add_growth", bench_sb_add_growth},
+    {"parse_short", bench_parse_short},
+    {"parse_long_quoted", bench_parse_long_quoted},
+    {"parse_inplace_long", bench_parse_inplace_long},
+    {"parse_inplace_huge", bench_parse_inplace_huge},
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+  int repeat = MB_REPEAT;
+  const char *filter = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:f:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'r':
+      repeat = atoi(optarg);
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    default:
+      fprintf(stderr, MB_USAGE);
+      return EXIT_FAILURE;
+    }
+  }
+  if (repeat <= 0 || optind != argc)
+  {
+    fprintf(stderr, MB_USAGE);
+    return EXIT_FAILURE;
+  }
+
+  double *ns = malloc(repeat * sizeof(double));
+  if (!ns)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+
+  printf("%-20s %10s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+  {
+    const MicroBench *b = &benches[i];
+    if (filter && !strstr(b->name, filter))
+      continue;
+    size_t ops = 0;
+    for (int r = 0; r < repeat; r++)
+    {
+      ops = b->run();
+      ns[r] = cur.ns / ops;
+    }
+    qsort(ns, repeat, sizeof(double), cmp_double);
+    /* Allocation counts are deterministic; the last run's are reported */
+    printf("%-20s %10zu %12.1f %12.3f %12.1f\n", b->name, ops, ns[repeat / 2],
+           (double)cur.calls / ops, (double)cur.bytes / ops);
+  }
+  free(ns);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,21 @@
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+#include <stddef.h>
+
+#define MB_REPEAT 5        /* timed repetitions per benchmark; the median is reported */
+#define MB_ENTRIES 100000  /* entries in the large hash_map / history fills */
+#define MB_COLLIDING 2000  /* keys sharing one home slot */
+#define MB_COLLIDE_BITS 12 /* ... in a table of 1 << MB_COLLIDE_BITS slots */
+#define MB_HUGE_WORDS 10000 /* arguments on the longest parsed line */
+
+#define MB_USAGE "Usage: wsh-microbench [-r repeat] [-f filter]\n"
+
+// One microbenchmark. run sets up its inputs, brackets the measured loop
+// with mb_begin/mb_end, tears down and returns the number of operations
+typedef struct {
+    const char *name;
+    size_t (*run)(void);
+} MicroBench;
+
+#endif // MICROBENCH_H
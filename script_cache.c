@@ -0,0 +1,367 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "script_cache.h"
+
+#define SC_MAGIC "WSHIR02"
+#define SC_ALIGN 8
+
+/*
+ * File layout: ScHeader, then the line records, the path records and the
+ * PATH string. A line record is four uint32 (flags, argc, line length, args
+ * length; lengths include NULs) followed by the line and the words; a path
+ * record is two uint32 lengths followed by the name and the path. Records
+ * are padded to SC_ALIGN bytes.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t dev, ino, size, mtime_sec, mtime_nsec; // Script identity
+    uint64_t nlines, lines_off, lines_len;
+    uint64_t npaths, paths_off, paths_len;
+    uint64_t env_off, env_len;
+    uint64_t total;
+} ScHeader;
+
+static const char zeros[SC_ALIGN];
+
+static void put_u32(StrBuf *sb, uint32_t v)
+{
+  sb_add(sb, (const char *)&v, sizeof(v));
+}
+
+static uint32_t get_u32(const char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static size_t pad(size_t n)
+{
+  return (n + SC_ALIGN - 1) & ~(size_t)(SC_ALIGN - 1);
+}
+
+static void sb_pad(StrBuf *sb)
+{
+  sb_add(sb, zeros, pad(sb->len) - sb->len);
+}
+
+static const ScHeader *header(const ScriptIR *ir)
+{
+  return (const ScHeader *)ir->data;
+}
+
+/**
+ * @Brief Add a line that is tokenized when it runs
+ *
+ * @param b Builder
+ * @param line Script line as read
+ */
+void sc_add_raw(ScBuilder *b, const char *line)
+{
+  size_t line_len = strlen(line) + 1;
+  put_u32(&b->lines, SC_LINE_RAW);
+  put_u32(&b->lines, 0);
+  put_u32(&b->lines, line_len);
+  put_u32(&b->lines, 0);
+  sb_add(&b->lines, line, line_len);
+  sb_pad(&b->lines);
+  b->nlines++;
+}
+
+/**
+ * @Brief Add a pre-tokenized line
+ *
+ * @param b Builder
+ * @param line Script line as read
+ * @param argv Its words
+ * @param argc Number of words
+ */
+void sc_add_argv(ScBuilder *b, const char *line, char **argv, int argc)
+{
+  size_t line_len = strlen(line) + 1;
+  size_t args_len = 0;
+  for (int i = 0; i < argc; i++)
+    args_len += strlen(argv[i]) + 1;
+
+  put_u32(&b->lines, 0);
+  put_u32(&b->lines, argc);
+  put_u32(&b->lines, line_len);
+  put_u32(&b->lines, args_len);
+  sb_add(&b->lines, line, line_len);
+  for (int i = 0; i < argc; i++)
+    sb_add(&b->lines, argv[i], strlen(argv[i]) + 1);
+  sb_pad(&b->lines);
+  b->nlines++;
+}
+
+/**
+ * @Brief Record a resolved command path
+ *
+ * @param b Builder
+ * @param name Command name
+ * @param path Executable it resolved to
+ */
+void sc_add_path(ScBuilder *b, const char *name, const char *path)
+{
+  size_t name_len = strlen(name) + 1;
+  size_t path_len = strlen(path) + 1;
+  put_u32(&b->paths, name_len);
+  put_u32(&b->paths, path_len);
+  sb_add(&b->paths, name, name_len);
+  sb_add(&b->paths, path, path_len);
+  sb_pad(&b->paths);
+  b->npaths++;
+}
+
+/**
+ * @Brief Assemble the builder's records into one IR
+ *
+ * @param b Builder, emptied on return
+ * @param script_st stat of the script the IR was compiled from
+ * @param env_path PATH at compile time (NULL for none)
+ * @return The new IR
+ */
+ScriptIR *sc_finish(ScBuilder *b, const struct stat *script_st, const char *env_path)
+{
+  if (!env_path)
+    env_path = "";
+  size_t env_len = strlen(env_path) + 1;
+
+  ScHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SC_MAGIC, sizeof(SC_MAGIC));
+  h.dev = script_st->st_dev;
+  h.ino = script_st->st_ino;
+  h.size = script_st->st_size;
+  h.mtime_sec = script_st->st_mtim.tv_sec;
+  h.mtime_nsec = script_st->st_mtim.tv_nsec;
+  h.nlines = b->nlines;
+  h.lines_off = sizeof(ScHeader);
+  h.lines_len = b->lines.len;
+  h.npaths = b->npaths;
+  h.paths_off = h.lines_off + h.lines_len;
+  h.paths_len = b->paths.len;
+  h.env_off = h.paths_off + h.paths_len;
+  h.env_len = env_len;
+  h.total = h.env_off + env_len;
+
+  ScriptIR *ir = malloc(sizeof(ScriptIR));
+  char *data = malloc(h.total);
+  if (!ir || !data)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+  memcpy(data, &h, sizeof(h));
+  if (b->lines.len)
+    memcpy(data + h.lines_off, b->lines.data, b->lines.len);
+  if (b->paths.len)
+    memcpy(data + h.paths_off, b->paths.data, b->paths.len);
+  memcpy(data + h.env_off, env_path, env_len);
+
+  sb_free(&b->lines);
+  sb_free(&b->paths);
+  b->nlines = b->npaths = 0;
+
+  ir->data = data;
+  ir->len = h.total;
+  ir->mapped = 0;
+  return ir;
+}
+
+/**
+ * @Brief Write an IR to a cache file, replacing it atomically
+ *
+ * @param ir IR to save
+ * @param cache_file Destination
+ * @return 0 on success, -1 on error
+ */
+int sc_save(const ScriptIR *ir, const char *cache_file)
+{
+  size_t n = strlen(cache_file) + 32;
+  char *tmp = malloc(n);
+  if (!tmp)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+  snprintf(tmp, n, "%s.%ld.tmp", cache_file, (long)getpid());
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    free(tmp);
+    return -1;
+  }
+  StrBuf view = {ir->data, ir->len, ir->len};
+  int ret = sb_write_fd(&view, fd);
+  if (close(fd) < 0)
+    ret = -1;
+  if (ret == 0 && rename(tmp, cache_file) < 0)
+    ret = -1;
+  if (ret != 0)
+    unlink(tmp);
+  free(tmp);
+  return ret;
+}
+
+/* Check that every record lies inside the IR and its strings are terminated */
+static int sc_valid(const ScriptIR *ir)
+{
+  const ScHeader *h = header(ir);
+  if (h->total != ir->len || h->lines_off != sizeof(ScHeader) ||
+      h->paths_off != h->lines_off + h->lines_len ||
+      h->env_off != h->paths_off + h->paths_len ||
+      h->env_len == 0 || h->total != h->env_off + h->env_len ||
+      ir->data[h->total - 1] != '\0')
+    return 0;
+
+  uint64_t count = 0;
+  for (size_t pos = 0; pos < h->lines_len; count++)
+  {
+    if (h->lines_len - pos < 16)
+      return 0;
+    const char *rec = ir->data + h->lines_off + pos;
+    uint32_t argc = get_u32(rec + 4);
+    uint64_t line_len = get_u32(rec + 8);
+    uint64_t args_len = get_u32(rec + 12);
+    if (line_len == 0 || 16 + line_len + args_len > h->lines_len - pos)
+      return 0;
+    const char *line = rec + 16;
+    const char *args = line + line_len;
+    if (line[line_len - 1] != '\0' || (args_len > 0 && args[args_len - 1] != '\0'))
+      return 0;
+    uint32_t words = 0;
+    for (uint64_t i = 0; i < args_len; i++)
+      words += args[i] == '\0';
+    if (words != argc)
+      return 0;
+    pos += pad(16 + line_len + args_len);
+  }
+  if (count != h->nlines)
+    return 0;
+
+  count = 0;
+  for (size_t pos = 0; pos < h->paths_len; count++)
+  {
+    if (h->paths_len - pos < 8)
+      return 0;
+    const char *rec = ir->data + h->paths_off + pos;
+    uint64_t name_len = get_u32(rec);
+    uint64_t path_len = get_u32(rec + 4);
+    if (name_len == 0 || path_len == 0 || 8 + name_len + path_len > h->paths_len - pos ||
+        rec[8 + name_len - 1] != '\0' || rec[8 + name_len + path_len - 1] != '\0')
+      return 0;
+    pos += pad(8 + name_len + path_len);
+  }
+  return count == h->npaths;
+}
+
+/**
+ * @Brief Map a cache file if it is a valid IR of the given script
+ *
+ * @param cache_file File written by sc_save
+ * @param script_st Current stat of the script
+ * @return The mapped IR, or NULL if missing, stale or corrupt
+ */
+ScriptIR *sc_load(const char *cache_file, const struct stat *script_st)
+{
+  int fd = open(cache_file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ScHeader))
+  {
+    close(fd);
+    return NULL;
+  }
+  /* Private and writable: words are handed out as mutable argv strings */
+  char *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  ScriptIR probe = {data, st.st_size, 1};
+  const ScHeader *h = header(&probe);
+  if (memcmp(h->magic, SC_MAGIC, sizeof(SC_MAGIC)) != 0 ||
+      h->dev != (uint64_t)script_st->st_dev || h->ino != (uint64_t)script_st->st_ino ||
+      h->size != (uint64_t)script_st->st_size ||
+      h->mtime_sec != (uint64_t)script_st->st_mtim.tv_sec ||
+      h->mtime_nsec != (uint64_t)script_st->st_mtim.tv_nsec ||
+      !sc_valid(&probe))
+  {
+    munmap(data, st.st_size);
+    return NULL;
+  }
+
+  ScriptIR *ir = malloc(sizeof(ScriptIR));
+  if (!ir)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+  *ir = probe;
+  return ir;
+}
+
+const char *sc_env_path(const ScriptIR *ir)
+{
+  return ir->data + header(ir)->env_off;
+}
+
+/**
+ * @Brief Read the line record at *pos and advance past it
+ *
+ * @return 1 if a line was read, 0 after the last one
+ */
+int sc_next_line(const ScriptIR *ir, size_t *pos, ScLine *out)
+{
+  const ScHeader *h = header(ir);
+  if (*pos >= h->lines_len)
+    return 0;
+  char *rec = ir->data + h->lines_off + *pos;
+  uint32_t line_len = get_u32(rec + 8);
+  uint32_t args_len = get_u32(rec + 12);
+  out->flags = get_u32(rec);
+  out->argc = get_u32(rec + 4);
+  out->line = rec + 16;
+  out->args = rec + 16 + line_len;
+  *pos += pad(16 + (size_t)line_len + args_len);
+  return 1;
+}
+
+/**
+ * @Brief Read the path record at *pos and advance past it
+ *
+ * @return 1 if a path was read, 0 after the last one
+ */
+int sc_next_path(const ScriptIR *ir, size_t *pos, const char **name, const char **path)
+{
+  const ScHeader *h = header(ir);
+  if (*pos >= h->paths_len)
+    return 0;
+  const char *rec = ir->data + h->paths_off + *pos;
+  uint32_t name_len = get_u32(rec);
+  uint32_t path_len = get_u32(rec + 4);
+  *name = rec + 8;
+  *path = rec + 8 + name_len;
+  *pos += pad(8 + (size_t)name_len + path_len);
+  return 1;
+}
+
+void sc_free(ScriptIR *ir)
+{
+  if (!ir)
+    return;
+  if (ir->mapped)
+    munmap(ir->data, ir->len);
+  else
+    free(ir->data);
+  free(ir);
+}
@@ -0,0 +1,69 @@
+#ifndef SCRIPT_CACHE_H
+#define SCRIPT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "utils.h"
+
+// Line flags
+#define SC_LINE_RAW 0x1 // must be tokenized when run (substitutions, parse errors)
+
+// Compiled form of a batch script: one record per script line plus the
+// command paths resolved when it was compiled. Either built in memory or
+// mapped (private, writable) from a cache file; the layout is the same
+typedef struct {
+    char *data;
+    size_t len;
+    int mapped;  // 1 if data is an mmap of a cache file
+} ScriptIR;
+
+// One line of a ScriptIR; strings point into the IR
+typedef struct {
+    uint32_t flags;
+    uint32_t argc;     // Number of NUL-terminated words in args (0 for raw lines)
+    char *line;        // Script line as read, newline included
+    char *args;        // Words back to back
+} ScLine;
+
+// Accumulates lines and paths for a new ScriptIR
+typedef struct {
+    StrBuf lines;
+    StrBuf paths;
+    uint64_t nlines;
+    uint64_t npaths;
+} ScBuilder;
+
+// Add a line that is tokenized when it runs
+void sc_add_raw(ScBuilder *b, const char *line);
+
+// Add a pre-tokenized line
+void sc_add_argv(ScBuilder *b, const char *line, char **argv, int argc);
+
+// Record that command name resolved to path
+void sc_add_path(ScBuilder *b, const char *name, const char *path);
+
+// Turn the builder (which is emptied) into an IR for the script described by
+// script_st, compiled under the given PATH
+ScriptIR *sc_finish(ScBuilder *b, const struct stat *script_st, const char *env_path);
+
+// Write ir to cache_file atomically (0 on success, -1 on error)
+int sc_save(const ScriptIR *ir, const char *cache_file);
+
+// Map cache_file if it holds a valid IR for the script described by
+// script_st, otherwise NULL
+ScriptIR *sc_load(const char *cache_file, const struct stat *script_st);
+
+// PATH the IR was compiled under
+const char *sc_env_path(const ScriptIR *ir);
+
+// Step through lines: *pos starts at 0; returns 0 after the last line
+int sc_next_line(const ScriptIR *ir, size_t *pos, ScLine *out);
+
+// Step through resolved paths the same way
+int sc_next_path(const ScriptIR *ir, size_t *pos, const char **name, const char **path);
+
+// Release the IR (unmapping it if it was loaded)
+void sc_free(ScriptIR *ir);
+
+#endif // SCRIPT_CACHE_H
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Operators are recognized only as unquoted words typed on the line: the
+# output of $(...) and quoted words stay literal arguments.
+# Usage: tests/operators.sh [path/to/wsh]
+WSH=$(cd "$(dirname "${1:-./wsh}")" && pwd)/$(basename "${1:-./wsh}")
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+cat > script <<'WSH'
+echo $(echo '|') z
+echo a '|' b
+echo $(echo '>') f
+echo '>f' g
+echo a '&'
+echo $(echo '&') h
+echo x | tr x y
+WSH
+
+cat > expected <<'OUT'
+| z
+a | b
+> f
+>f g
+a &
+& h
+y
+OUT
+
+WSH_SCRIPT_CACHE= "$WSH" script > actual 2>&1
+status=0
+if ! cmp -s expected actual; then
+  echo "operators: unexpected output" >&2
+  diff expected actual >&2
+  status=1
+fi
+for f in f z b g; do
+  if [ -e "$f" ]; then
+    echo "operators: a literal operator created file $f" >&2
+    status=1
+  fi
+done
+[ $status -eq 0 ] && echo "operators: ok"
+exit $status
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+#include "utils.h"
+
+int trace_enabled = 0;
+
+static TraceEvent *events = NULL;
+static size_t nevents = 0;
+static size_t dropped = 0;
+static uint64_t trace_start = 0;
+static pid_t trace_owner = 0;
+static char *trace_path = NULL;
+
+uint64_t trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return trace_ts(&ts);
+}
+
+uint64_t trace_ts(const struct timespec *ts)
+{
+  return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/**
+ * @Brief Enable tracing; the event buffer is allocated once, up front
+ *
+ * @param path Output file, "%p" standing for the pid so nested shells
+ * do not overwrite each other's traces
+ */
+void trace_init(const char *path)
+{
+  events = malloc(TRACE_MAX_EVENTS * sizeof(TraceEvent));
+  if (!events)
+  {
+    perror("malloc");
+    exit(-1);
+  }
+
+  StrBuf sb = {0};
+  char pid[24];
+  snprintf(pid, sizeof(pid), "%ld", (long)getpid());
+  for (const char *p = path; *p; p++)
+  {
+    if (p[0] == '%' && p[1] == 'p')
+    {
+      sb_puts(&sb, pid);
+      p++;
+    }
+    else
+      sb_add(&sb, p, 1);
+  }
+  sb_add(&sb, "", 1);
+
+  trace_path = sb.data;
+  trace_owner = getpid();
+  trace_start = trace_now();
+  trace_enabled = 1;
+}
+
+void trace_span(const char *name, uint64_t start, uint64_t end, const char *detail,
+                int pid, int child)
+{
+  if (nevents == TRACE_MAX_EVENTS)
+  {
+    dropped++;
+    return;
+  }
+  TraceEvent *ev = &events[nevents++];
+  ev->name = name;
+  ev->start = start;
+  ev->end = end;
+  ev->pid = pid;
+  ev->child = child;
+  size_t n = 0;
+  if (detail)
+  {
+    /* First line only: command lines keep their newline */
+    while (n < TRACE_DETAIL - 1 && detail[n] && detail[n] != '\n')
+      n++;
+    memcpy(ev->detail, detail, n);
+  }
+  ev->detail[n] = '\0';
+}
+
+/* Write s as the body of a JSON string */
+static void json_escape(FILE *fp, const char *s)
+{
+  for (; *s; s++)
+  {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+}
+
+/* Microseconds since trace_init, the unit of Chrome trace timestamps */
+static double trace_us(uint64_t ns)
+{
+  return ns >= trace_start ? (ns - trace_start) / 1000.0 : 0;
+}
+
+void trace_flush(void)
+{
+  if (!trace_enabled)
+    return;
+  trace_enabled = 0;
+  if (getpid() != trace_owner)
+    return;
+
+  FILE *fp = fopen(trace_path, "we");
+  if (!fp)
+  {
+    perror(trace_path);
+  }
+  else
+  {
+    int shell = (int)trace_owner;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"wsh\"}}",
+            shell, shell);
+    for (size_t i = 0; i < nevents; i++)
+    {
+      const TraceEvent *ev = &events[i];
+      int pid = ev->pid ? ev->pid : shell;
+      fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"wsh\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                  "\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"",
+              ev->name, trace_us(ev->start), (ev->end - ev->start) / 1000.0, pid, pid);
+      json_escape(fp, ev->detail);
+      fprintf(fp, "\"");
+      if (ev->child)
+        fprintf(fp, ",\"child\":%d", ev->child);
+      fprintf(fp, "}}");
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%zu}}\n", dropped);
+    if (fclose(fp) != 0)
+      perror(trace_path);
+  }
+
+  free(events);
+  events = NULL;
+  nevents = dropped = 0;
+  free(trace_path);
+  trace_path = NULL;
+}
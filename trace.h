@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define TRACE_MAX_EVENTS 65536  // spans kept; later ones are counted as dropped
+#define TRACE_DETAIL 40         // bytes of detail text kept per span
+
+// A complete span, written out as a Chrome trace "X" event
+typedef struct {
+    const char *name;           // phase; must be a string literal
+    uint64_t start;             // CLOCK_MONOTONIC ns
+    uint64_t end;
+    int pid;                    // track: a child's pid, or 0 for the shell
+    int child;                  // pid of the child the span started, 0 if none
+    char detail[TRACE_DETAIL];  // e.g. the command name, truncated
+} TraceEvent;
+
+// Non-zero while tracing; checked inline so disabled tracing costs a branch
+extern int trace_enabled;
+
+// Start tracing into path ("%p" is replaced by the shell's pid); written by trace_flush
+void trace_init(const char *path);
+
+// Current CLOCK_MONOTONIC time in ns
+uint64_t trace_now(void);
+
+// Convert a CLOCK_MONOTONIC timespec to ns
+uint64_t trace_ts(const struct timespec *ts);
+
+// Record a span on the shell's track (pid 0) or a child's
+void trace_span(const char *name, uint64_t start, uint64_t end, const char *detail,
+                int pid, int child);
+
+// Write the spans as Chrome/Perfetto JSON and stop tracing. Only the process
+// that called trace_init writes; forked children drop their spans
+void trace_flush(void);
+
+#define TRACE_BEGIN() (trace_enabled ? trace_now() : 0)
+#define TRACE_END(name, start, detail, child)                            \
+    do {                                                                 \
+        if (trace_enabled)                                               \
+            trace_span((name), (start), trace_now(), (detail), 0, (child)); \
+    } while (0)
+
+#endif // TRACE_H
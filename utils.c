@@ -1,4 +1,6 @@
 #include "utils.h"
+#include <errno.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -50,3 +52,97 @@ char *append(char *dest, const char *src)
   memcpy(new_str + dest_len, src, src_len + 1); // copy including '\0'
   return new_str;
 }
+
+/* Make room for n more bytes in sb */
+static void sb_reserve(StrBuf *sb, size_t n)
+{
+  if (sb->len + n <= sb->cap)
+    return;
+  size_t cap = sb->cap ? sb->cap : 4096;
+  while (sb->len + n > cap)
+    cap *= 2;
+  char *tmp = realloc(sb->data, cap);
+  if (!tmp)
+  {
+    perror("realloc");
+    exit(-1);
+  }
+  sb->data = tmp;
+  sb->cap = cap;
+}
+
+/* Append n bytes of s to sb */
+void sb_add(StrBuf *sb, const char *s, size_t n)
+{
+  if (n == 0)
+    return; /* an empty buffer has no data to memcpy into */
+  sb_reserve(sb, n);
+  memcpy(sb->data + sb->len, s, n);
+  sb->len += n;
+}
+
+/* Append the NUL-terminated string s to sb */
+void sb_puts(StrBuf *sb, const char *s)
+{
+  sb_add(sb, s, strlen(s));
+}
+
+/* Append printf-style formatted text to sb */
+void sb_printf(StrBuf *sb, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (n < 0)
+    return;
+
+  sb_reserve(sb, (size_t)n + 1);
+  va_start(args, fmt);
+  vsnprintf(sb->data + sb->len, (size_t)n + 1, fmt, args);
+  va_end(args);
+  sb->len += (size_t)n;
+}
+
+/* Write the whole buffer to fd (retrying short writes); 0 on success, -1 on error */
+int sb_write_fd(const StrBuf *sb, int fd)
+{
+  const char *p = sb->data;
+  size_t left = sb->len;
+  while (left > 0)
+  {
+    ssize_t n = write(fd, p, left);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    left -= (size_t)n;
+  }
+  return 0;
+}
+
+/* Flush stdout and write the buffer to it, then empty the buffer. A closed
+   reader (EPIPE) is not reported; returns -1 on any failure */
+int sb_flush_stdout(StrBuf *sb)
+{
+  if (sb->len == 0)
+    return 0;
+  fflush(stdout);
+  int res = sb_write_fd(sb, STDOUT_FILENO);
+  if (res != 0 && errno != EPIPE)
+    perror("write");
+  sb->len = 0;
+  return res;
+}
+
+/* Release the buffer's memory */
+void sb_free(StrBuf *sb)
+{
+  free(sb->data);
+  sb->data = NULL;
+  sb->len = 0;
+  sb->cap = 0;
+}
@@ -1,3 +1,6 @@
+#ifndef UTILS_H
+#define UTILS_H
+
 #include <unistd.h>
 
 char *replaceAt(const char *command, const size_t i, const size_t n, const char *value);
@@ -6,3 +9,30 @@ char *replaceKey(const char *command, const char *key, const char *value);
 
 /* Append src to the end of dest */
 char *append(char *dest, const char *src);
+
+/* Growable byte buffer for building output that is written out in one go */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} StrBuf;
+
+/* Append n bytes of s to sb */
+void sb_add(StrBuf *sb, const char *s, size_t n);
+
+/* Append the NUL-terminated string s to sb */
+void sb_puts(StrBuf *sb, const char *s);
+
+/* Append printf-style formatted text to sb */
+void sb_printf(StrBuf *sb, const char *fmt, ...);
+
+/* Write the whole buffer to fd (retrying short writes); 0 on success, -1 on error */
+int sb_write_fd(const StrBuf *sb, int fd);
+
+/* Flush stdout and write the buffer to it, then empty the buffer (-1 on error) */
+int sb_flush_stdout(StrBuf *sb);
+
+/* Release the buffer's memory */
+void sb_free(StrBuf *sb);
+
+#endif // UTILS_H
@@ -1,13 +1,27 @@
+#define _GNU_SOURCE /* pipe2, F_SETPIPE_SZ, close_range */
 #include "wsh.h"
-#include "dynamic_array.h"
+#include "history.h"
 #include "utils.h"
 #include "hash_map.h"
+#include "arena.h"
+#include "fdcopy.h"
+#include "script_cache.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -15,22 +29,133 @@
 /* ===== Global state ===== */
 int rc = EXIT_SUCCESS;
 HashMap *alias_hm = NULL;
-static DynamicArray *history_da = NULL;
+static History *history = NULL;
+static Arena *cmd_arena = NULL; /* per-command-line scratch memory, reset after each line */
+static HashMap *path_cache = NULL; /* command name -> resolved executable path */
+/* Resolutions made when a batch script was compiled; an entry moves into
+   path_cache the first time its command runs */
+static HashMap *script_paths = NULL;
+static unsigned long path_cache_hits = 0;
+static unsigned long path_cache_misses = 0;
+
+/* Cumulative counters for the stats builtin, bumped on the hot paths */
+typedef struct
+{
+  unsigned long commands;      /* run_command calls (substitutions included) */
+  unsigned long pipelines;
+  unsigned long stages;        /* stages of those pipelines */
+  unsigned long forks;         /* fork() calls: fork launches, forked builtins, background jobs */
+  unsigned long execs;         /* external programs started (posix_spawn or fork + execv) */
+  unsigned long builtins;      /* builtins run inside the shell */
+  unsigned long path_lookups;  /* find_in_path calls (path cache misses) */
+  unsigned long access_probes; /* access() calls while resolving commands */
+  unsigned long aliases;       /* alias expansions */
+  unsigned long parse_allocs;  /* allocations made while tokenizing */
+  unsigned long parse_bytes;
+  unsigned long waits;         /* blocking waits for children */
+  unsigned long wait_ns;       /* time spent in them */
+} ShellStats;
+
+static ShellStats stats;
+
+/* CLOCK_MONOTONIC in ns, for timing waits */
+static unsigned long monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Outcome of one stage (or the single command) of the last command line */
+typedef struct
+{
+  const char *name;         /* argv[0]; lives in cmd_arena */
+  int status;               /* wait status */
+  struct timespec start;    /* CLOCK_MONOTONIC at launch */
+  struct timespec end;      /* CLOCK_MONOTONIC at reap */
+  struct rusage usage;      /* from wait4, or a getrusage delta for builtins */
+  pid_t pid;                /* child that ran the stage, 0 if it ran in the shell */
+} StageResult;
+
+static StageResult *last_stages = NULL; /* read by pipestatus and time */
+static int last_stages_len = 0;
+static int last_stages_cap = 0;
+static int opt_pipefail = 0; /* set -o pipefail */
+static int interactive_shell = 0;
+
+/* A command line started with a trailing & */
+typedef struct
+{
+  int id;       /* number shown by jobs and accepted by wait */
+  pid_t pid;    /* subshell running the line */
+  int status;   /* wait status, valid once done */
+  int done;
+  char *cmd;    /* command text for jobs */
+} Job;
+
+/* Descriptors opened for a command's redirections, -1 where not redirected */
+typedef struct
+{
+  int in;   /* < file */
+  int out;  /* > file or >> file */
+  int err;  /* 2> file or 2>> file */
+} Redirs;
+
+static Job *jobs = NULL;
+static int jobs_len = 0;
+static int jobs_cap = 0;
+static int next_job_id = 1;
+static volatile sig_atomic_t child_exited = 0; /* set by the SIGCHLD handler */
 
 #define RC_EXIT_REQUEST 2 /* internal: user asked to exit */
 
+extern char **environ;
+
+/* How external programs are started, chosen at startup from LAUNCH_ENV */
+typedef enum
+{
+  LAUNCH_SPAWN, /* posix_spawn (vfork-style, no page-table copy) */
+  LAUNCH_FORK   /* fork + execv */
+} LaunchMode;
+static LaunchMode launch_mode = LAUNCH_SPAWN;
+static int pipe_size = 0; /* F_SETPIPE_SZ for pipeline pipes from PIPE_SIZE_ENV, 0 = kernel default */
+
 void wsh_free(void)
 {
+  trace_flush();
   if (alias_hm)
   {
     hm_free(alias_hm);
     alias_hm = NULL;
   }
-  if (history_da)
+  if (history)
+  {
+    hist_free(history);
+    history = NULL;
+  }
+  if (path_cache)
+  {
+    hm_free(path_cache);
+    path_cache = NULL;
+  }
+  if (script_paths)
+  {
+    hm_free(script_paths);
+    script_paths = NULL;
+  }
+  if (cmd_arena)
   {
-    da_free(history_da);
-    history_da = NULL;
+    arena_free(cmd_arena);
+    cmd_arena = NULL;
   }
+  free(last_stages);
+  last_stages = NULL;
+  last_stages_len = last_stages_cap = 0;
+  for (int i = 0; i < jobs_len; i++)
+    free(jobs[i].cmd);
+  free(jobs);
+  jobs = NULL;
+  jobs_len = jobs_cap = 0;
 }
 
 void clean_exit(int return_code)
@@ -48,101 +173,318 @@ void wsh_warn(const char *msg, ...)
   rc = EXIT_FAILURE;
 }
 
-void parseline_no_subst(const char *cmdline, char **argv, int *argc)
+static int command_substitute(char *cmd, StrBuf *out);
+
+/* Matching ')' of a "$(" whose body starts at p (quotes respected), or NULL */
+static char *subst_end(char *p)
 {
-  if (!cmdline)
+  int depth = 1;
+  for (; *p; p++)
   {
-    *argc = 0;
-    argv[0] = NULL;
-    return;
+    if (*p == '\'')
+    {
+      p = strchr(p + 1, '\'');
+      if (!p)
+        return NULL;
+    }
+    else if (*p == '(')
+    {
+      depth++;
+    }
+    else if (*p == ')' && --depth == 0)
+    {
+      return p;
+    }
   }
+  return NULL;
+}
 
-  char *buf = strdup(cmdline);
-  if (!buf)
-  {
-    perror("strdup");
-    clean_exit(EXIT_FAILURE);
-  }
+/* Make room for n entries in av, growing geometrically */
+static void av_reserve(ArgVec *av, int n)
+{
+  if (n <= av->cap)
+    return;
+  int cap = av->cap ? av->cap : 16;
+  while (cap < n)
+    cap *= 2;
 
-  size_t len = strlen(buf);
-  if (len > 0 && buf[len - 1] == '\n')
+  char **argv;
+  if (av->arena)
   {
-    buf[len - 1] = ' ';
+    argv = arena_alloc(av->arena, cap * sizeof(char *));
+    if (av->argc > 0)
+      memcpy(argv, av->argv, av->argc * sizeof(char *));
   }
   else
   {
-    char *new_buf = realloc(buf, len + 2);
-    if (!new_buf)
+    argv = realloc(av->argv, cap * sizeof(char *));
+    if (!argv)
     {
       perror("realloc");
-      free(buf);
       clean_exit(EXIT_FAILURE);
     }
-    buf = new_buf;
-    strcat(buf, " ");
   }
+  stats.parse_allocs++;
+  stats.parse_bytes += cap * sizeof(char *);
+  av->argv = argv;
+  av->cap = cap;
+}
 
-  int count = 0;
-  char *p = buf;
+/* Append word, keeping av->argv NULL-terminated */
+static void av_push(ArgVec *av, char *word)
+{
+  av_reserve(av, av->argc + 2);
+  av->argv[av->argc++] = word;
+  av->argv[av->argc] = NULL;
+}
+
+/* Empty av, keeping its buffer */
+static void av_clear(ArgVec *av)
+{
+  av_reserve(av, 1);
+  av->argc = 0;
+  av->argv[0] = NULL;
+}
 
-  while (*p && *p == ' ')
+void argvec_free(ArgVec *av)
+{
+  if (!av->arena)
+    free(av->argv);
+  av->argv = NULL;
+  av->argc = av->cap = 0;
+}
+
+/*
+ * Replace every $(...) in token with the output of running it, then split
+ * the result on whitespace into words appended to av (a token expanding
+ * to nothing yields no word). Words live in cmd_arena. Returns -1 on error.
+ */
+static int expand_token(char *token, ArgVec *av)
+{
+  StrBuf text = {0};
+  char *t = token;
+  while (*t)
   {
-    p++;
+    char *open = strstr(t, "$(");
+    if (!open)
+    {
+      sb_puts(&text, t);
+      break;
+    }
+    sb_add(&text, t, open - t);
+    char *close = subst_end(open + 2);
+    *close = '\0';
+    if (command_substitute(open + 2, &text) < 0)
+    {
+      sb_free(&text);
+      return -1;
+    }
+    t = close + 1;
   }
 
-  while (*p)
+  size_t i = 0;
+  while (i < text.len)
   {
-    char *token_start = p;
-    char *token = NULL;
+    while (i < text.len && strchr(" \t\n", text.data[i]))
+      i++;
+    size_t start = i;
+    while (i < text.len && !strchr(" \t\n", text.data[i]))
+      i++;
+    if (i == start)
+      break;
+    char *word = arena_alloc(cmd_arena, i - start + 1);
+    stats.parse_allocs++;
+    stats.parse_bytes += i - start + 1;
+    memcpy(word, text.data + start, i - start);
+    word[i - start] = '\0';
+    av_push(av, word);
+  }
+  sb_free(&text);
+  return 0;
+}
+
+/*
+ * Redirection operators as the tokenizer emits them. An unquoted operator
+ * always becomes one of these pointers, so parse_redirs can tell it from a
+ * quoted word with the same text ('>', which points into the line).
+ */
+static char *const redir_ops[] = {"<", ">", ">>", "2>", "2>>"};
+
+/* Length of the redirection operator w starts with, 0 if none */
+static size_t redir_op_len(const char *w)
+{
+  if (w[0] == '<')
+    return 1;
+  if (w[0] == '>')
+    return w[1] == '>' ? 2 : 1;
+  if (w[0] == '2' && w[1] == '>')
+    return w[2] == '>' ? 3 : 2;
+  return 0;
+}
+
+/* The redir_ops entry for the len-byte operator at p */
+static char *redir_op_word(const char *p, size_t len)
+{
+  for (size_t i = 0; i < sizeof(redir_ops) / sizeof(redir_ops[0]); i++)
+    if (strlen(redir_ops[i]) == len && memcmp(redir_ops[i], p, len) == 0)
+      return redir_ops[i];
+  return NULL;
+}
+
+/* Whether w is an operator emitted by the tokenizer (not merely one's text) */
+static int is_redir_op(const char *w)
+{
+  for (size_t i = 0; i < sizeof(redir_ops) / sizeof(redir_ops[0]); i++)
+    if (w == redir_ops[i])
+      return 1;
+  return 0;
+}
+
+/*
+ * Control operators, emitted the same way: only an unquoted | or & word
+ * becomes op_pipe or op_amp, never a quoted one or the output of $(...)
+ */
+static char op_pipe[] = "|";
+static char op_amp[] = "&";
+
+/* Map a word of a pre-tokenized (cached) line back to its operator, if it is one */
+static char *cached_word(char *w)
+{
+  if (strcmp(w, op_pipe) == 0)
+    return op_pipe;
+  if (strcmp(w, op_amp) == 0)
+    return op_amp;
+  return w;
+}
+
+#define PARSE_SUBST 0x1 /* expand $(...) */
+#define PARSE_QUIET 0x2 /* report errors only through the return value */
+
+/* Tokenizer behind parseline_inplace and parseline_no_subst; words go into av */
+static int parse_words(char *buf, ArgVec *av, int flags)
+{
+  char *p = buf;
+
+  av_clear(av);
+  if (!buf)
+    return 0;
+
+  size_t len = strlen(buf);
+  if (len > 0 && buf[len - 1] == '\n')
+    buf[len - 1] = '\0';
+
+  while (1)
+  {
+    while (*p == ' ')
+      p++;
+    if (*p == '\0')
+      break;
+
+    /* An unquoted operator is a word of its own, even when the file name follows directly */
+    size_t op_len = redir_op_len(p);
+    if (op_len)
+    {
+      av_push(av, redir_op_word(p, op_len));
+      p += op_len;
+      continue;
+    }
+    if ((*p == '|' || *p == '&') && (p[1] == ' ' || p[1] == '\0'))
+    {
+      av_push(av, *p == '|' ? op_pipe : op_amp);
+      p++;
+      continue;
+    }
 
+    char *token_start = p;
     if (*p == '\'')
     {
       token_start = ++p;
-      token = strchr(p, '\'');
-      if (!token)
+      char *close_quote = strchr(p, '\'');
+      if (!close_quote)
       {
-        wsh_warn(MISSING_CLOSING_QUOTE);
-
-        free(buf);
-        for (int i = 0; i < count; i++)
-          free(argv[i]);
-        *argc = 0;
-        argv[0] = NULL;
-        return;
+        if (!(flags & PARSE_QUIET))
+          wsh_warn(MISSING_CLOSING_QUOTE);
+        av_clear(av);
+        return -1;
       }
-
-      *token = '\0';
-      p = token + 1;
+      *close_quote = '\0';
+      p = close_quote + 1;
     }
     else
     {
-      token = strchr(p, ' ');
-      if (!token)
-        break;
-      *token = '\0';
-      p = token + 1;
+      int has_subst = 0;
+      while (*p && *p != ' ')
+      {
+        if ((flags & PARSE_SUBST) && p[0] == '$' && p[1] == '(')
+        {
+          char *close = subst_end(p + 2);
+          if (!close)
+          {
+            if (!(flags & PARSE_QUIET))
+              wsh_warn(UNMATCHED_PAREN);
+            av_clear(av);
+            return -1;
+          }
+          has_subst = 1;
+          p = close;
+        }
+        p++;
+      }
+      if (*p)
+        *p++ = '\0';
+
+      if (has_subst)
+      {
+        if (expand_token(token_start, av) < 0)
+        {
+          av_clear(av);
+          return -1;
+        }
+        continue;
+      }
     }
 
-    argv[count] = strdup(token_start);
-    if (!argv[count])
+    av_push(av, token_start);
+  }
+  return 0;
+}
+
+int parseline_inplace(char *buf, ArgVec *av)
+{
+  return parse_words(buf, av, PARSE_SUBST);
+}
+
+void parseline_no_subst(const char *cmdline, ArgVec *av)
+{
+  av_clear(av);
+  if (!cmdline)
+    return;
+
+  char *buf = strdup(cmdline);
+  if (!buf)
+  {
+    perror("strdup");
+    clean_exit(EXIT_FAILURE);
+  }
+  stats.parse_allocs++;
+  stats.parse_bytes += strlen(cmdline) + 1;
+
+  parse_words(buf, av, 0);
+  for (int i = 0; i < av->argc; i++)
+  {
+    stats.parse_allocs++;
+    stats.parse_bytes += strlen(av->argv[i]) + 1;
+    av->argv[i] = strdup(av->argv[i]);
+    if (!av->argv[i])
     {
       perror("strdup");
-      for (int i = 0; i < count; i++)
-        free(argv[i]);
+      for (int j = 0; j < i; j++)
+        free(av->argv[j]);
       free(buf);
       clean_exit(EXIT_FAILURE);
     }
-    count++;
-
-    while (*p && *p == ' ')
-    {
-      p++;
-    }
   }
 
-  argv[count] = NULL;
-  *argc = count;
-
   free(buf);
 }
 
@@ -153,177 +495,650 @@ static int is_abs_or_rel(const char *s)
   return (s[0] == '/' || s[0] == '.') ? 1 : 0;
 }
 
-/* Returns malloc'ed path or NULL. Prints EMPTY_PATH if PATH is empty/unset. */
-static char *find_in_path(const char *cmd)
+/*
+ * Search PATH for cmd, adding the access() calls made to *probes (if not
+ * NULL). Returns a path allocated from cmd_arena, or NULL, also when PATH is
+ * empty or unset.
+ */
+static char *search_path(const char *cmd, unsigned long *probes)
 {
-  char *path_env = getenv("PATH");
+  const char *path_env = getenv("PATH");
   if (!path_env || path_env[0] == '\0')
-  {
-    fprintf(stderr, EMPTY_PATH);
     return NULL;
-  }
 
-  char *copy = strdup(path_env);
-  if (!copy)
-  {
-    perror("strdup");
-    return NULL;
-  }
+  /* One candidate buffer large enough for any PATH entry + "/" + cmd */
+  size_t cmd_len = strlen(cmd);
+  char *full = arena_alloc(cmd_arena, strlen(path_env) + 1 + cmd_len + 1);
 
-  char *save = NULL;
-  char *tok = strtok_r(copy, ":", &save);
-  while (tok)
+  const char *dir = path_env;
+  while (1)
   {
-    if (tok[0] != '\0')
+    const char *colon = strchr(dir, ':');
+    size_t dir_len = colon ? (size_t)(colon - dir) : strlen(dir);
+    if (dir_len > 0)
     {
-      size_t a = strlen(tok), b = strlen(cmd);
-      char *full = (char *)malloc(a + 1 + b + 1);
-      if (!full)
-      {
-        free(copy);
-        return NULL;
-      }
-      snprintf(full, a + 1 + b + 1, "%s/%s", tok, cmd);
+      memcpy(full, dir, dir_len);
+      full[dir_len] = '/';
+      memcpy(full + dir_len + 1, cmd, cmd_len + 1);
 
+      if (probes)
+        (*probes)++;
       if (access(full, X_OK) == 0)
-      {
-        free(copy);
         return full;
-      }
-      free(full);
     }
-    tok = strtok_r(NULL, ":", &save);
+    if (!colon)
+      break;
+    dir = colon + 1;
   }
 
-  free(copy);
   return NULL;
 }
 
-static int execute_one(char **argv)
+/* search_path for running cmd: counted in stats. Prints EMPTY_PATH if PATH is empty/unset. */
+static char *find_in_path(const char *cmd)
 {
-  if (!argv || !argv[0])
-    return EXIT_SUCCESS;
-
-  char *exec_path = NULL;
-  if (is_abs_or_rel(argv[0]))
+  const char *path_env = getenv("PATH");
+  if (!path_env || path_env[0] == '\0')
   {
-    exec_path = strdup(argv[0]);
-    if (!exec_path)
-    {
-      perror("strdup");
-      return EXIT_FAILURE;
-    }
+    fprintf(stderr, EMPTY_PATH);
+    return NULL;
   }
+  stats.path_lookups++;
+  return search_path(cmd, &stats.access_probes);
+}
+
+/* Drop every cached resolution, e.g. after PATH changed */
+static void path_cache_clear(void)
+{
+  if (path_cache)
+    hm_reset(path_cache);
   else
+    path_cache = hm_create();
+  if (script_paths)
   {
-    exec_path = find_in_path(argv[0]);
-    if (!exec_path)
-    {
-      if (getenv("PATH") && getenv("PATH")[0] != '\0')
-      {
-        fprintf(stderr, CMD_NOT_FOUND, argv[0]);
-      }
-      return EXIT_FAILURE;
-    }
+    hm_free(script_paths);
+    script_paths = NULL;
   }
+}
 
-  pid_t pid = fork();
-  if (pid < 0)
-  {
-    perror("fork");
-    free(exec_path);
-    return EXIT_FAILURE;
-  }
+/* Forget a single cached resolution, e.g. after exec of it failed */
+static void path_cache_forget(const char *cmd)
+{
+  if (path_cache)
+    hm_delete(path_cache, cmd);
+  if (script_paths)
+    hm_delete(script_paths, cmd);
+}
 
-  if (pid == 0)
+/*
+ * Resolve cmd against PATH, consulting the cache first, then the compiled
+ * script's resolutions (checked with one access()). The returned string
+ * is owned by the cache and stays valid until the entry is forgotten or the
+ * cache is cleared. Returns NULL if not found (find_in_path reports an empty
+ * PATH).
+ */
+static const char *resolve_command(const char *cmd)
+{
+  if (!path_cache)
+    path_cache = hm_create();
+
+  const char *cached = hm_get(path_cache, cmd);
+  if (cached)
   {
-    execv(exec_path, argv);
-    fprintf(stderr, CMD_NOT_FOUND, argv[0]);
-    _exit(1);
+    path_cache_hits++;
+    return cached;
   }
 
-  free(exec_path);
-
-  int status = 0;
-  if (waitpid(pid, &status, 0) < 0)
+  path_cache_misses++;
+  const char *known = script_paths ? hm_get(script_paths, cmd) : NULL;
+  if (known)
   {
-    perror("waitpid");
-    return EXIT_FAILURE;
+    stats.access_probes++;
+    if (access(known, X_OK) == 0)
+    {
+      hm_put(path_cache, cmd, known);
+      return hm_get(path_cache, cmd);
+    }
   }
 
-  if (WIFEXITED(status))
+  uint64_t t0 = TRACE_BEGIN();
+  const char *full = find_in_path(cmd);
+  TRACE_END("find_in_path", t0, cmd, 0);
+  if (!full)
+    return NULL;
+  hm_put(path_cache, cmd, full);
+  return hm_get(path_cache, cmd);
+}
+
+static void redirs_close(Redirs *r)
+{
+  int *fds[] = {&r->in, &r->out, &r->err};
+  for (int i = 0; i < 3; i++)
   {
-    return (WEXITSTATUS(status) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (*fds[i] >= 0)
+      close(*fds[i]);
+    *fds[i] = -1;
   }
-  return EXIT_FAILURE;
 }
 
-static void history_init(void)
+/*
+ * Strip the redirections from argv (compacting it in place and updating
+ * *argc) and open their files, left to right like other shells, so a later
+ * redirection of the same stream wins but every file is still created. Only
+ * operators emitted by the tokenizer count, each followed by its file. Files are
+ * close-on-exec: launches dup2 them onto the standard streams, which is the
+ * only way a child sees them. Appends use O_APPEND, so each write lands at
+ * the current end of file even with several writers. Returns -1 after
+ * reporting an error, with nothing left open.
+ */
+static int parse_redirs(char **argv, int *argc, Redirs *r)
 {
-  history_da = da_create(16);
+  r->in = r->out = r->err = -1;
+  int n = 0;
+  for (int i = 0; i < *argc; i++)
+  {
+    char *w = argv[i];
+    if (!is_redir_op(w))
+    {
+      argv[n++] = w;
+      continue;
+    }
+
+    if (i + 1 == *argc || is_redir_op(argv[i + 1]))
+    {
+      fprintf(stderr, REDIRECT_NO_FILE, w);
+      redirs_close(r);
+      return -1;
+    }
+    const char *file = argv[++i];
+    if (*file == '&')
+    {
+      fprintf(stderr, REDIRECT_UNSUPPORTED, file);
+      redirs_close(r);
+      return -1;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int *slot = w[0] == '2' ? &r->err : &r->out;
+    if (w[0] == '<')
+    {
+      flags = O_RDONLY;
+      slot = &r->in;
+    }
+    else if (strcmp(w, ">>") == 0 || strcmp(w, "2>>") == 0)
+    {
+      flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+
+    int fd = open(file, flags | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+      fprintf(stderr, REDIRECT_OPEN_FAILED, file, strerror(errno));
+      redirs_close(r);
+      return -1;
+    }
+    if (*slot >= 0)
+      close(*slot);
+    *slot = fd;
+  }
+  argv[n] = NULL;
+  *argc = n;
+  return 0;
 }
 
-static void history_add_raw_line(const char *line)
+/* Exit status used by a child whose execv failed */
+#define EXEC_FAILED_STATUS 127
+
+/*
+ * Start exec_path with argv in a new process. When in_fd/out_fd/err_fd are
+ * not -1 they become the child's stdin/stdout/stderr; every other descriptor
+ * above stderr is closed in the child. Returns the child's pid, or -1 if it
+ * could not be started. With LAUNCH_SPAWN an exec failure is reported here
+ * (-1); with LAUNCH_FORK the child exits with EXEC_FAILED_STATUS instead.
+ * SIGPIPE is reset to its default in the child: an in-shell builtin such as
+ * parallel may be launching it while the shell ignores SIGPIPE.
+ */
+static pid_t launch_external(const char *exec_path, char **argv, int in_fd, int out_fd,
+                             int err_fd)
 {
-  if (!history_da || !line)
-    return;
+  pid_t pid;
+  uint64_t t0 = TRACE_BEGIN();
 
-  char *tmp = strdup(line);
-  if (!tmp)
+  stats.execs++;
+  if (launch_mode == LAUNCH_FORK)
   {
-    perror("strdup");
-    return;
+    stats.forks++;
+    pid = fork();
+    if (pid < 0)
+    {
+      perror("fork");
+      return -1;
+    }
+    if (pid == 0)
+    {
+      if (in_fd >= 0 && dup2(in_fd, STDIN_FILENO) < 0)
+        _exit(1);
+      if (out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0)
+        _exit(1);
+      if (err_fd >= 0 && dup2(err_fd, STDERR_FILENO) < 0)
+        _exit(1);
+      close_range(3, ~0U, 0);
+      signal(SIGPIPE, SIG_DFL);
+      execv(exec_path, argv);
+      fprintf(stderr, CMD_NOT_FOUND, argv[0]);
+      _exit(EXEC_FAILED_STATUS);
+    }
+    TRACE_END("fork", t0, argv[0], pid);
+    return pid;
   }
 
-  size_t len = strlen(tmp);
-  if (len > 0 && tmp[len - 1] == '\n')
-    tmp[len - 1] = '\0';
+  /* Children get stdin/stdout/stderr only; anything else the shell holds is closed */
+  posix_spawn_file_actions_t fa;
+  if (posix_spawn_file_actions_init(&fa) != 0)
+  {
+    perror("posix_spawn_file_actions_init");
+    return -1;
+  }
+  if (in_fd >= 0)
+    posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+  if (out_fd >= 0)
+    posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+  if (err_fd >= 0)
+    posix_spawn_file_actions_adddup2(&fa, err_fd, STDERR_FILENO);
+  posix_spawn_file_actions_addclosefrom_np(&fa, 3);
+
+  static posix_spawnattr_t attr;
+  static int attr_ready = 0;
+  if (!attr_ready)
+  {
+    sigset_t dfl;
+    sigemptyset(&dfl);
+    sigaddset(&dfl, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &dfl);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    attr_ready = 1;
+  }
 
-  da_put(history_da, tmp);
-  free(tmp);
+  int err = posix_spawn(&pid, exec_path, &fa, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  if (err != 0)
+  {
+    if (err == ENOENT || err == EACCES || err == ENOEXEC || err == ENOTDIR)
+    {
+      fprintf(stderr, CMD_NOT_FOUND, argv[0]);
+    }
+    else
+    {
+      errno = err;
+      perror("posix_spawn");
+    }
+    return -1;
+  }
+  TRACE_END("spawn", t0, argv[0], pid);
+  return pid;
 }
 
-static const char *history_get_line(size_t idx)
+/* Exit code for a wait status: the exit status, or 128 + signal number */
+static int status_code(int status)
 {
-  if (!history_da)
-    return NULL;
-  return da_get(history_da, idx);
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
 }
 
-static size_t history_count(void)
+static void stage_begin(StageResult *st, const char *name)
 {
-  if (!history_da)
-    return 0;
-  return history_da->size;
+  memset(st, 0, sizeof(*st));
+  st->name = name;
+  clock_gettime(CLOCK_MONOTONIC, &st->start);
+  st->end = st->start;
 }
 
-static int is_builtin_name(const char *name)
+/* A stage that never ran: exit code only, zero time */
+static void stage_fail(StageResult *st, int code)
 {
-  if (!name)
-    return 0;
-  return strcmp(name, "exit") == 0 ||
-         strcmp(name, "path") == 0 ||
-         strcmp(name, "cd") == 0 ||
-         strcmp(name, "which") == 0 ||
-         strcmp(name, "history") == 0 ||
-         strcmp(name, "alias") == 0 ||
-         strcmp(name, "unalias") == 0;
+  st->status = W_EXITCODE(code, 0);
+  st->end = st->start;
 }
 
-static int builtin_exit(int argc, char **argv)
+/* Reap pid into st, collecting its resource usage. Returns -1 on failure */
+static int stage_reap(StageResult *st, pid_t pid)
 {
-  (void)argv;
-  if (argc != 1)
+  int ret = 0;
+  st->pid = pid;
+  if (wait4(pid, &st->status, 0, &st->usage) < 0)
   {
-    fprintf(stderr, INVALID_EXIT_USE);
-    return EXIT_FAILURE;
+    perror("wait4");
+    st->status = W_EXITCODE(1, 0);
+    ret = -1;
   }
-  return RC_EXIT_REQUEST; /* signal caller to exit cleanly */
+  clock_gettime(CLOCK_MONOTONIC, &st->end);
+  return ret;
 }
 
-static int builtin_path(int argc, char **argv)
+/* Remember the last command's stages for pipestatus and time (and trace them) */
+static void record_stages(const StageResult *stages, int n)
 {
-  if (argc == 1)
+  if (trace_enabled)
+  {
+    for (int i = 0; i < n; i++)
+      trace_span("stage", trace_ts(&stages[i].start), trace_ts(&stages[i].end), stages[i].name,
+                 stages[i].pid, 0);
+  }
+  if (n > last_stages_cap)
+  {
+    StageResult *tmp = realloc(last_stages, n * sizeof(StageResult));
+    if (!tmp)
+    {
+      perror("realloc");
+      return;
+    }
+    last_stages = tmp;
+    last_stages_cap = n;
+  }
+  memcpy(last_stages, stages, n * sizeof(StageResult));
+  last_stages_len = n;
+}
+
+/* Run one external command with its redirections */
+static int execute_one(char **argv, const Redirs *r)
+{
+  if (!argv || !argv[0])
+    return EXIT_SUCCESS;
+
+  StageResult st;
+  stage_begin(&st, argv[0]);
+  const char *exec_path = NULL;
+  int from_cache = 0;
+  if (is_abs_or_rel(argv[0]))
+  {
+    exec_path = argv[0];
+  }
+  else
+  {
+    from_cache = 1;
+    exec_path = resolve_command(argv[0]);
+    if (!exec_path)
+    {
+      if (getenv("PATH") && getenv("PATH")[0] != '\0')
+      {
+        fprintf(stderr, CMD_NOT_FOUND, argv[0]);
+      }
+      stage_fail(&st, EXEC_FAILED_STATUS);
+      record_stages(&st, 1);
+      return EXIT_FAILURE;
+    }
+  }
+
+  pid_t pid = launch_external(exec_path, argv, r->in, r->out, r->err);
+  if (pid < 0)
+  {
+    if (from_cache)
+      path_cache_forget(argv[0]);
+    stage_fail(&st, EXEC_FAILED_STATUS);
+    record_stages(&st, 1);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t t0 = TRACE_BEGIN();
+  unsigned long w0 = monotonic_ns();
+  int failed = stage_reap(&st, pid);
+  stats.wait_ns += monotonic_ns() - w0;
+  stats.waits++;
+  TRACE_END("wait", t0, argv[0], pid);
+  record_stages(&st, 1);
+  if (failed)
+    return EXIT_FAILURE;
+
+  int status = st.status;
+  if (WIFEXITED(status))
+  {
+    /* A stale cache entry (binary moved or removed) must not stick around */
+    if (from_cache && WEXITSTATUS(status) == EXEC_FAILED_STATUS)
+      path_cache_forget(argv[0]);
+    return (WEXITSTATUS(status) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  return EXIT_FAILURE;
+}
+
+/* Pipeline pipes get PIPE_SIZE_ENV bytes of buffer (k/m suffixes allowed) if set to a valid size */
+static void pipe_size_init(void)
+{
+  const char *env = getenv(PIPE_SIZE_ENV);
+  if (!env || env[0] == '\0')
+    return;
+
+  char *end = NULL;
+  errno = 0;
+  long size = strtol(env, &end, 10);
+  long unit = 1;
+  if (*end == 'k' || *end == 'K')
+  {
+    unit = 1024;
+    end++;
+  }
+  else if (*end == 'm' || *end == 'M')
+  {
+    unit = 1024 * 1024;
+    end++;
+  }
+  /* Range-check before scaling so a huge count cannot overflow */
+  if (errno != 0 || *end != '\0' || size <= 0 || size > PIPE_SIZE_MAX / unit)
+  {
+    fprintf(stderr, INVALID_PIPE_SIZE, env);
+    return;
+  }
+  pipe_size = (int)(size * unit);
+}
+
+/* History keeps HISTSIZE_ENV entries if set to a valid number, else HISTSIZE_DEFAULT */
+static void history_init(void)
+{
+  size_t size = HISTSIZE_DEFAULT;
+  const char *env = getenv(HISTSIZE_ENV);
+  if (env && *env)
+  {
+    char *endp = NULL;
+    long val = strtol(env, &endp, 10);
+    if (*endp == '\0' && val >= 0)
+      size = (size_t)val;
+  }
+  history = hist_create(size);
+}
+
+/*
+ * Persist history to HISTFILE_ENV, or to HISTFILE_DEFAULT under $HOME in
+ * interactive mode. An empty HISTFILE_ENV disables persistence.
+ */
+static void history_open_file(int interactive)
+{
+  const char *file = getenv(HISTFILE_ENV);
+  char *buf = NULL;
+  if (!file)
+  {
+    const char *home = getenv("HOME");
+    if (!interactive || !home || home[0] == '\0')
+      return;
+    size_t n = strlen(home) + 1 + strlen(HISTFILE_DEFAULT) + 1;
+    buf = malloc(n);
+    if (!buf)
+    {
+      perror("malloc");
+      return;
+    }
+    snprintf(buf, n, "%s/%s", home, HISTFILE_DEFAULT);
+    file = buf;
+  }
+  if (file[0] != '\0' && hist_attach_file(history, file) != 0)
+    perror(file);
+  free(buf);
+}
+
+static void history_add_raw_line(const char *line)
+{
+  if (!history || !line)
+    return;
+
+  size_t len = strlen(line);
+  if (len > 0 && line[len - 1] == '\n')
+    len--;
+  hist_add(history, line, len);
+}
+
+static const char *history_get_line(size_t idx)
+{
+  if (!history)
+    return NULL;
+  return hist_get(history, idx);
+}
+
+static size_t history_count(void)
+{
+  if (!history)
+    return 0;
+  return hist_count(history);
+}
+
+/* ===== Background jobs ===== */
+
+/*
+ * SIGCHLD only raises a flag; jobs are reaped by pid at safe points between
+ * commands. Reaping with waitpid(-1) in the handler would also steal the
+ * foreground children that run_pipeline and execute_one wait for.
+ */
+static void on_sigchld(int sig)
+{
+  (void)sig;
+  child_exited = 1;
+}
+
+static void jobs_init(void)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_sigchld;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  if (sigaction(SIGCHLD, &sa, NULL) < 0)
+    perror("sigaction");
+}
+
+/* Collect every finished job without blocking (only after a SIGCHLD unless forced) */
+static void jobs_reap(int force)
+{
+  if (!force && !child_exited)
+    return;
+  child_exited = 0;
+  for (int i = 0; i < jobs_len; i++)
+  {
+    if (!jobs[i].done && waitpid(jobs[i].pid, &jobs[i].status, WNOHANG) == jobs[i].pid)
+      jobs[i].done = 1;
+  }
+}
+
+/* Block until job i has finished */
+static void job_wait(int i)
+{
+  unsigned long w0 = monotonic_ns();
+  stats.waits++;
+  while (!jobs[i].done)
+  {
+    if (waitpid(jobs[i].pid, &jobs[i].status, 0) == jobs[i].pid)
+    {
+      jobs[i].done = 1;
+    }
+    else if (errno != EINTR)
+    {
+      perror("waitpid");
+      jobs[i].status = W_EXITCODE(1, 0);
+      jobs[i].done = 1;
+    }
+  }
+  stats.wait_ns += monotonic_ns() - w0;
+}
+
+static void job_remove(int i)
+{
+  free(jobs[i].cmd);
+  memmove(&jobs[i], &jobs[i + 1], (jobs_len - i - 1) * sizeof(Job));
+  jobs_len--;
+}
+
+static int job_find(int id)
+{
+  for (int i = 0; i < jobs_len; i++)
+    if (jobs[i].id == id)
+      return i;
+  return -1;
+}
+
+static void job_print(const Job *job)
+{
+  if (!job->done)
+    printf(JOB_RUNNING, job->id, job->cmd);
+  else if (WIFSIGNALED(job->status))
+    printf(JOB_SIGNALED, job->id, WTERMSIG(job->status), job->cmd);
+  else if (WEXITSTATUS(job->status) != 0)
+    printf(JOB_EXITED, job->id, WEXITSTATUS(job->status), job->cmd);
+  else
+    printf(JOB_DONE, job->id, job->cmd);
+}
+
+/* Interactive mode reports (and forgets) finished jobs before each prompt */
+static void jobs_notify(void)
+{
+  jobs_reap(0);
+  for (int i = 0; i < jobs_len;)
+  {
+    if (jobs[i].done)
+    {
+      job_print(&jobs[i]);
+      job_remove(i);
+    }
+    else
+    {
+      i++;
+    }
+  }
+  fflush(stdout);
+}
+
+/* ===== Builtin registry ===== */
+typedef int (*builtin_fn)(int argc, char **argv);
+
+#define BUILTIN_STDIN 0x1 /* reads stdin; run_pipeline decides whether it can stay in-process */
+
+typedef struct
+{
+  const char *name;
+  builtin_fn fn;
+  int flags;
+  /* For a builtin standing in for the external command of the same name
+     (cat, tee): the option letters it implements. Given any other option,
+     the external command runs instead. NULL for the shell's own builtins */
+  const char *opts;
+} Builtin;
+
+static const Builtin *find_builtin(const char *name);
+static int run_command(char **argv, int argc);
+
+static int builtin_exit(int argc, char **argv)
+{
+  (void)argv;
+  if (argc != 1)
+  {
+    fprintf(stderr, INVALID_EXIT_USE);
+    return EXIT_FAILURE;
+  }
+  return RC_EXIT_REQUEST; /* signal caller to exit cleanly */
+}
+
+static int builtin_path(int argc, char **argv)
+{
+  if (argc == 1)
   {
     char *val = getenv("PATH");
     if (!val)
@@ -340,6 +1155,7 @@ static int builtin_path(int argc, char **argv)
       perror("setenv");
       return EXIT_FAILURE;
     }
+    path_cache_clear();
     return EXIT_SUCCESS;
   }
 
@@ -398,7 +1214,7 @@ static int builtin_which(int argc, char **argv)
     return EXIT_SUCCESS;
   }
 
-  if (is_builtin_name(name))
+  if (find_builtin(name))
   {
     printf(WHICH_BUILTIN, name);
     fflush(stdout);
@@ -421,7 +1237,7 @@ static int builtin_which(int argc, char **argv)
     }
   }
 
-  char *resolved = find_in_path(name);
+  const char *resolved = resolve_command(name);
   if (!resolved)
   {
     printf(WHICH_NOT_FOUND, name);
@@ -430,7 +1246,98 @@ static int builtin_which(int argc, char **argv)
   }
   printf(WHICH_EXTERNAL, name, resolved);
   fflush(stdout);
-  free(resolved);
+  return EXIT_SUCCESS;
+}
+
+static int builtin_hash(int argc, char **argv)
+{
+  if (argc == 1)
+  {
+    if (path_cache)
+      hm_print_sorted(path_cache);
+    printf(HASH_STATS, path_cache_hits, path_cache_misses);
+    fflush(stdout);
+    return EXIT_SUCCESS;
+  }
+
+  if (argc == 2 && strcmp(argv[1], "-r") == 0)
+  {
+    path_cache_clear();
+    path_cache_hits = 0;
+    path_cache_misses = 0;
+    return EXIT_SUCCESS;
+  }
+
+  int code = EXIT_SUCCESS;
+  for (int i = 1; i < argc; i++)
+  {
+    if (argv[i][0] == '-' || is_abs_or_rel(argv[i]))
+    {
+      fprintf(stderr, INVALID_HASH_USE);
+      return EXIT_FAILURE;
+    }
+    if (!resolve_command(argv[i]))
+    {
+      fprintf(stderr, HASH_NOT_FOUND, argv[i]);
+      code = EXIT_FAILURE;
+    }
+  }
+  return code;
+}
+
+static int builtin_stats(int argc, char **argv)
+{
+  int machine = 0;
+  int reset = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-m") == 0)
+      machine = 1;
+    else if (strcmp(argv[i], "-r") == 0)
+      reset = 1;
+    else
+    {
+      fprintf(stderr, INVALID_STATS_USE);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* -r alone resets quietly; -m -r prints a sample and starts the next one */
+  if (machine || !reset)
+  {
+    const struct
+    {
+      const char *key;
+      unsigned long value;
+    } rows[] = {
+        {"commands", stats.commands},
+        {"pipelines", stats.pipelines},
+        {"stages", stats.stages},
+        {"forks", stats.forks},
+        {"execs", stats.execs},
+        {"builtins", stats.builtins},
+        {"find_in_path", stats.path_lookups},
+        {"access", stats.access_probes},
+        {"aliases", stats.aliases},
+        {"parse_allocs", stats.parse_allocs},
+        {"parse_bytes", stats.parse_bytes},
+        {"waits", stats.waits},
+        {"wait_ns", stats.wait_ns},
+    };
+    size_t nrows = sizeof(rows) / sizeof(rows[0]);
+    for (size_t i = 0; i < nrows; i++)
+    {
+      if (machine)
+        printf(i ? " %s=%lu" : "%s=%lu", rows[i].key, rows[i].value);
+      else
+        printf(STATS_ROW, rows[i].key, rows[i].value);
+    }
+    if (machine)
+      printf("\n");
+    fflush(stdout);
+  }
+  if (reset)
+    memset(&stats, 0, sizeof(stats));
   return EXIT_SUCCESS;
 }
 
@@ -438,16 +1345,35 @@ static int builtin_history(int argc, char **argv)
 {
   if (argc == 1)
   {
+    /* Batched into pipe-sized writes rather than one write per line */
+    StrBuf out = {NULL, 0, 0};
     size_t n = history_count();
     for (size_t i = 0; i < n; i++)
     {
       const char *line = history_get_line(i);
       if (line)
       {
-        printf("%s\n", line);
-        fflush(stdout);
+        sb_puts(&out, line);
+        sb_add(&out, "\n", 1);
+        if (out.len >= 65536 && sb_flush_stdout(&out) != 0)
+          break;
       }
     }
+    int res = sb_flush_stdout(&out);
+    sb_free(&out);
+    return res == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (argc == 3 && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-p") == 0))
+  {
+    size_t *matches = NULL;
+    size_t n = history ? hist_search(history, argv[2], argv[1][1] == 'p', &matches) : 0;
+    StrBuf out = {NULL, 0, 0};
+    for (size_t i = 0; i < n; i++)
+      sb_printf(&out, HISTORY_MATCH, matches[i] + 1, history_get_line(matches[i]));
+    sb_flush_stdout(&out);
+    sb_free(&out);
+    free(matches);
     return EXIT_SUCCESS;
   }
 
@@ -486,7 +1412,16 @@ static int builtin_alias(int argc, char **argv)
   if (argc == 1)
   {
     hm_print_sorted(alias_hm);
-    fflush(stdout);
+    return EXIT_SUCCESS;
+  }
+
+  /* alias prefix* lists the aliases starting with prefix */
+  size_t arg_len = strlen(argv[1]);
+  if (argc == 2 && arg_len > 0 && argv[1][arg_len - 1] == '*')
+  {
+    argv[1][arg_len - 1] = '\0';
+    hm_print_prefix(alias_hm, argv[1]);
+    argv[1][arg_len - 1] = '*';
     return EXIT_SUCCESS;
   }
 
@@ -513,185 +1448,1027 @@ static int builtin_alias(int argc, char **argv)
   return EXIT_SUCCESS;
 }
 
-static int builtin_unalias(int argc, char **argv)
+static int builtin_unalias(int argc, char **argv)
+{
+  if (argc != 2 || !argv[1] || argv[1][0] == '\0')
+  {
+    fprintf(stderr, INVALID_UNALIAS_USE);
+    return EXIT_FAILURE;
+  }
+  hm_delete(alias_hm, argv[1]);
+  return EXIT_SUCCESS;
+}
+
+/* Options toggled with set -o name / set +o name */
+static const struct
+{
+  const char *name;
+  int *flag;
+} shell_options[] = {
+    {"pipefail", &opt_pipefail},
+};
+
+static int builtin_set(int argc, char **argv)
+{
+  size_t n_options = sizeof(shell_options) / sizeof(shell_options[0]);
+  if (argc == 1)
+  {
+    for (size_t i = 0; i < n_options; i++)
+      printf(SET_OPTION_STATE, shell_options[i].name, *shell_options[i].flag ? "on" : "off");
+    fflush(stdout);
+    return EXIT_SUCCESS;
+  }
+
+  if (argc == 3 && (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "+o") == 0))
+  {
+    for (size_t i = 0; i < n_options; i++)
+    {
+      if (strcmp(argv[2], shell_options[i].name) == 0)
+      {
+        *shell_options[i].flag = (argv[1][0] == '-');
+        return EXIT_SUCCESS;
+      }
+    }
+  }
+
+  fprintf(stderr, INVALID_SET_USE);
+  return EXIT_FAILURE;
+}
+
+static int builtin_pipestatus(int argc, char **argv)
+{
+  (void)argv;
+  if (argc != 1)
+  {
+    fprintf(stderr, INVALID_PIPESTATUS_USE);
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < last_stages_len; i++)
+    printf(i ? " %d" : "%d", status_code(last_stages[i].status));
+  printf("\n");
+  fflush(stdout);
+  return EXIT_SUCCESS;
+}
+
+/* jobs: list background jobs; finished ones are listed once, then forgotten */
+static int builtin_jobs(int argc, char **argv)
+{
+  (void)argv;
+  if (argc != 1)
+  {
+    fprintf(stderr, INVALID_JOBS_USE);
+    return EXIT_FAILURE;
+  }
+  jobs_reap(1);
+  for (int i = 0; i < jobs_len;)
+  {
+    job_print(&jobs[i]);
+    if (jobs[i].done)
+      job_remove(i);
+    else
+      i++;
+  }
+  fflush(stdout);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * wait [id ...]: block until the given jobs (all jobs without arguments)
+ * finish. Fails if a job is unknown or the last one waited for failed.
+ */
+static int builtin_wait(int argc, char **argv)
+{
+  if (argc == 1)
+  {
+    while (jobs_len > 0)
+    {
+      job_wait(0);
+      job_remove(0);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  int ret = EXIT_SUCCESS;
+  for (int a = 1; a < argc; a++)
+  {
+    const char *arg = argv[a][0] == '%' ? argv[a] + 1 : argv[a];
+    char *end = NULL;
+    long id = strtol(arg, &end, 10);
+    int i = (*arg && *end == '\0') ? job_find((int)id) : -1;
+    if (i < 0)
+    {
+      fprintf(stderr, WAIT_NO_SUCH_JOB, argv[a]);
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    job_wait(i);
+    ret = status_code(jobs[i].status) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    job_remove(i);
+  }
+  return ret;
+}
+
+/* One running job of parallel */
+typedef struct
+{
+  pid_t pid;
+  int pidfd;    /* -1 once reaped */
+  int out_fd;   /* read end of the job's stdout with -k, -1 otherwise or at EOF */
+  size_t item;
+} ParallelSlot;
+
+/* argv for one item: every {} in the template is replaced, or the item is appended */
+static char **parallel_argv(char **tmpl, int tmpl_argc, int has_placeholder, const char *item)
+{
+  char **out = arena_alloc(cmd_arena, (tmpl_argc + 2) * sizeof(char *));
+  size_t item_len = strlen(item);
+  for (int i = 0; i < tmpl_argc; i++)
+  {
+    const char *t = tmpl[i];
+    if (!strstr(t, "{}"))
+    {
+      out[i] = tmpl[i];
+      continue;
+    }
+    size_t n = 0;
+    for (const char *q = t; (q = strstr(q, "{}")); q += 2)
+      n++;
+    char *s = arena_alloc(cmd_arena, strlen(t) + n * item_len + 1);
+    char *d = s;
+    for (const char *q; (q = strstr(t, "{}")); t = q + 2)
+    {
+      memcpy(d, t, q - t);
+      d += q - t;
+      memcpy(d, item, item_len);
+      d += item_len;
+    }
+    strcpy(d, t);
+    out[i] = s;
+  }
+  out[tmpl_argc] = has_placeholder ? NULL : (char *)item;
+  out[tmpl_argc + 1] = NULL;
+  return out;
+}
+
+/* Read stdin to EOF and split it into non-empty lines, kept in buf */
+static char **parallel_read_items(StrBuf *buf, size_t *count)
+{
+  char chunk[1 << 16];
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) != 0)
+  {
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("read");
+      break;
+    }
+    sb_add(buf, chunk, n);
+  }
+  sb_add(buf, "\n", 1);
+
+  size_t lines = 0;
+  for (size_t i = 0; i < buf->len; i++)
+    lines += buf->data[i] == '\n';
+  char **items = arena_alloc(cmd_arena, (lines + 1) * sizeof(char *));
+  *count = 0;
+  char *line = buf->data;
+  for (size_t i = 0; i < buf->len; i++)
+  {
+    if (buf->data[i] != '\n')
+      continue;
+    buf->data[i] = '\0';
+    if (*line)
+      items[(*count)++] = line;
+    line = buf->data + i + 1;
+  }
+  return items;
+}
+
+/*
+ * parallel [-j N] [-k] command [arg ...] [::: item ...]: run command once per
+ * item (the ::: arguments, or else the lines of stdin) with at most N jobs at
+ * a time (default: one per CPU). {} in the arguments is replaced by the item,
+ * which is otherwise appended. The command is resolved once for all items.
+ * Jobs write straight to stdout, or with -k their output is collected and
+ * printed in item order. Fails if any job failed, after listing them.
+ */
+static int builtin_parallel(int argc, char **argv)
+{
+  long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int keep_order = 0;
+  int a = 1;
+  for (; a < argc && argv[a][0] == '-'; a++)
+  {
+    if (strcmp(argv[a], "-k") == 0)
+    {
+      keep_order = 1;
+      continue;
+    }
+    char *end = NULL;
+    if (strcmp(argv[a], "-j") != 0 || a + 1 == argc ||
+        (max_jobs = strtol(argv[a + 1], &end, 10)) < 1 || *end != '\0' || max_jobs > PARALLEL_MAX_JOBS)
+    {
+      fprintf(stderr, INVALID_PARALLEL_USE);
+      return EXIT_FAILURE;
+    }
+    a++;
+  }
+  if (max_jobs < 1)
+    max_jobs = 1;
+
+  char **tmpl = argv + a;
+  int tmpl_argc = 0;
+  while (a + tmpl_argc < argc && strcmp(tmpl[tmpl_argc], ":::") != 0)
+    tmpl_argc++;
+  if (tmpl_argc == 0)
+  {
+    fprintf(stderr, INVALID_PARALLEL_USE);
+    return EXIT_FAILURE;
+  }
+  const Builtin *b = find_builtin(tmpl[0]);
+  if (b && !b->opts)
+  {
+    fprintf(stderr, PARALLEL_BUILTIN, tmpl[0]);
+    return EXIT_FAILURE;
+  }
+  const char *path = is_abs_or_rel(tmpl[0]) ? tmpl[0] : resolve_command(tmpl[0]);
+  if (!path)
+  {
+    fprintf(stderr, CMD_NOT_FOUND, tmpl[0]);
+    return EXIT_FAILURE;
+  }
+
+  StrBuf input = {0};
+  char **items;
+  size_t nitems;
+  if (a + tmpl_argc < argc)
+  {
+    items = tmpl + tmpl_argc + 1;
+    nitems = argc - (a + tmpl_argc + 1);
+  }
+  else
+  {
+    items = parallel_read_items(&input, &nitems);
+  }
+
+  int has_placeholder = 0;
+  for (int i = 0; i < tmpl_argc; i++)
+    if (strstr(tmpl[i], "{}"))
+      has_placeholder = 1;
+
+  /* Jobs must not compete with parallel for stdin */
+  int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if ((size_t)max_jobs > nitems)
+    max_jobs = nitems ? (long)nitems : 1;
+  ParallelSlot *slots = arena_alloc(cmd_arena, max_jobs * sizeof(ParallelSlot));
+  struct pollfd *pfds = arena_alloc(cmd_arena, 2 * max_jobs * sizeof(struct pollfd));
+  int *pfd_slot = arena_alloc(cmd_arena, 2 * max_jobs * sizeof(int));
+  int *codes = arena_calloc(cmd_arena, nitems + 1, sizeof(int));
+  char *finished = arena_calloc(cmd_arena, nitems + 1, 1);
+  StrBuf *outputs = keep_order ? arena_calloc(cmd_arena, nitems + 1, sizeof(StrBuf)) : NULL;
+  for (long k = 0; k < max_jobs; k++)
+    slots[k].pid = 0;
+
+  size_t next = 0, done = 0, next_print = 0;
+  long running = 0;
+  fflush(stdout);
+  while (done < nitems)
+  {
+    /* Fill free slots */
+    for (long k = 0; k < max_jobs && next < nitems; k++)
+    {
+      if (slots[k].pid)
+        continue;
+      size_t item = next++;
+      char **job_argv = parallel_argv(tmpl, tmpl_argc, has_placeholder, items[item]);
+      int fds[2] = {-1, -1};
+      if (keep_order && pipe2(fds, O_CLOEXEC) < 0)
+        perror("pipe2");
+      pid_t pid = launch_external(path, job_argv, null_fd, fds[1], -1);
+      if (fds[1] >= 0)
+        close(fds[1]);
+      int pidfd = pid > 0 ? pidfd_open(pid, 0) : -1;
+      if (pid > 0 && pidfd < 0)
+      {
+        /* No pidfds: run this job to completion before going on */
+        if (fds[0] >= 0)
+        {
+          char chunk[1 << 16];
+          ssize_t n;
+          while ((n = read(fds[0], chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR))
+            if (n > 0)
+              sb_add(&outputs[item], chunk, n);
+        }
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+          ;
+        codes[item] = status_code(status);
+        pid = -1;
+      }
+      else if (pid < 0)
+      {
+        codes[item] = EXEC_FAILED_STATUS;
+      }
+      if (pid < 0)
+      {
+        if (fds[0] >= 0)
+          close(fds[0]);
+        finished[item] = 1;
+        done++;
+        k--; /* the slot is still free */
+        continue;
+      }
+      slots[k] = (ParallelSlot){pid, pidfd, fds[0], item};
+      running++;
+    }
+
+    if (running > 0)
+    {
+      int npfds = 0;
+      for (long k = 0; k < max_jobs; k++)
+      {
+        if (!slots[k].pid)
+          continue;
+        if (slots[k].pidfd >= 0)
+        {
+          pfds[npfds] = (struct pollfd){slots[k].pidfd, POLLIN, 0};
+          pfd_slot[npfds++] = k;
+        }
+        if (slots[k].out_fd >= 0)
+        {
+          pfds[npfds] = (struct pollfd){slots[k].out_fd, POLLIN, 0};
+          pfd_slot[npfds++] = k;
+        }
+      }
+      if (poll(pfds, npfds, -1) < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        perror("poll");
+        break;
+      }
+
+      for (int p = 0; p < npfds; p++)
+      {
+        if (!pfds[p].revents)
+          continue;
+        ParallelSlot *sl = &slots[pfd_slot[p]];
+        if (pfds[p].fd == sl->out_fd)
+        {
+          char chunk[1 << 16];
+          ssize_t n = read(sl->out_fd, chunk, sizeof(chunk));
+          if (n > 0)
+            sb_add(&outputs[sl->item], chunk, n);
+          else if (n == 0 || errno != EINTR)
+          {
+            close(sl->out_fd);
+            sl->out_fd = -1;
+          }
+        }
+        else
+        {
+          int status = 0;
+          while (waitpid(sl->pid, &status, 0) < 0 && errno == EINTR)
+            ;
+          codes[sl->item] = status_code(status);
+          close(sl->pidfd);
+          sl->pidfd = -1;
+        }
+        if (sl->pidfd < 0 && sl->out_fd < 0)
+        {
+          finished[sl->item] = 1;
+          sl->pid = 0;
+          running--;
+          done++;
+        }
+      }
+    }
+
+    /* With -k, print every finished job whose predecessors are all printed */
+    while (keep_order && next_print < nitems && finished[next_print])
+    {
+      sb_write_fd(&outputs[next_print], STDOUT_FILENO);
+      sb_free(&outputs[next_print]);
+      next_print++;
+    }
+  }
+
+  if (null_fd >= 0)
+    close(null_fd);
+
+  int failed = 0;
+  for (size_t i = 0; i < nitems; i++)
+  {
+    if (codes[i] != 0)
+    {
+      fprintf(stderr, PARALLEL_JOB_FAILED, codes[i], items[i]);
+      failed++;
+    }
+  }
+  if (failed)
+    fprintf(stderr, PARALLEL_SUMMARY, failed, nitems);
+  sb_free(&input);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* cat [file ...]: copy files (or stdin, also as "-") to stdout */
+static int builtin_cat(int argc, char **argv)
+{
+  static char *stdin_only[] = {"-", NULL};
+  char **files = argc > 1 ? argv + 1 : stdin_only;
+  int ret = EXIT_SUCCESS;
+
+  fflush(stdout);
+  for (; *files; files++)
+  {
+    int is_stdin = strcmp(*files, "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(*files, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      fprintf(stderr, BUILTIN_FILE_ERROR, "cat", *files, strerror(errno));
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    int failed = fd_copy(fd, STDOUT_FILENO) < 0;
+    int err = errno;
+    if (!is_stdin)
+      close(fd);
+    if (failed)
+    {
+      ret = EXIT_FAILURE;
+      if (err == EPIPE)
+        break; /* nobody is reading any more */
+      fprintf(stderr, BUILTIN_FILE_ERROR, "cat", *files, strerror(err));
+    }
+  }
+  return ret;
+}
+
+/* tee [-a] [file ...]: copy stdin to stdout and to each file (-a appends) */
+static int builtin_tee(int argc, char **argv)
+{
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC;
+  for (int i = 1; i < argc; i++)
+    if (strcmp(argv[i], "-a") == 0)
+      flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_APPEND;
+
+  int ret = EXIT_SUCCESS;
+  int *fds = arena_alloc(cmd_arena, argc * sizeof(int));
+  size_t nfds = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-a") == 0)
+      continue;
+    int fd = open(argv[i], flags, 0644);
+    if (fd < 0)
+    {
+      fprintf(stderr, BUILTIN_FILE_ERROR, "tee", argv[i], strerror(errno));
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    fds[nfds++] = fd;
+  }
+
+  fflush(stdout);
+  if (fd_tee(STDIN_FILENO, STDOUT_FILENO, fds, nfds) < 0)
+  {
+    if (errno != EPIPE)
+      fprintf(stderr, BUILTIN_FILE_ERROR, "tee", "write", strerror(errno));
+    ret = EXIT_FAILURE;
+  }
+  for (size_t k = 0; k < nfds; k++)
+    close(fds[k]);
+  return ret;
+}
+
+static double timespec_seconds(const struct timespec *end, const struct timespec *start)
+{
+  return (double)(end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double timeval_seconds(const struct timeval *tv)
+{
+  return (double)tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void print_stage_time(int machine, const char *label, int code, double real,
+                             const struct rusage *ru)
+{
+  fprintf(stderr, machine ? TIME_ROW_MACHINE : TIME_ROW, label, code, real,
+          timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime),
+          ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/*
+ * time [-m] command: runs command (which may be a whole pipeline) and reports
+ * wall, user and system time, max RSS and voluntary/involuntary context
+ * switches for each stage on stderr, plus a total line for pipelines. -m
+ * prints tab-separated rows without a header for aggregation.
+ */
+static int builtin_time(int argc, char **argv)
+{
+  int machine = 0;
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "-m") == 0)
+  {
+    machine = 1;
+    first = 2;
+  }
+  if (first >= argc)
+  {
+    fprintf(stderr, INVALID_TIME_USE);
+    return EXIT_FAILURE;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  last_stages_len = 0;
+  int code = run_command(argv + first, argc - first);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (!machine)
+    fprintf(stderr, TIME_HEADER);
+
+  struct rusage total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < last_stages_len; i++)
+  {
+    const StageResult *st = &last_stages[i];
+    print_stage_time(machine, st->name, status_code(st->status),
+                     timespec_seconds(&st->end, &st->start), &st->usage);
+
+    total.ru_utime.tv_sec += st->usage.ru_utime.tv_sec;
+    total.ru_utime.tv_usec += st->usage.ru_utime.tv_usec;
+    total.ru_stime.tv_sec += st->usage.ru_stime.tv_sec;
+    total.ru_stime.tv_usec += st->usage.ru_stime.tv_usec;
+    if (st->usage.ru_maxrss > total.ru_maxrss)
+      total.ru_maxrss = st->usage.ru_maxrss;
+    total.ru_nvcsw += st->usage.ru_nvcsw;
+    total.ru_nivcsw += st->usage.ru_nivcsw;
+  }
+  if (last_stages_len > 1)
+    print_stage_time(machine, TIME_TOTAL_LABEL, code == EXIT_SUCCESS ? 0 : 1,
+                     timespec_seconds(&end, &start), &total);
+  return code;
+}
+
+enum
+{
+  BI_ALIAS,
+  BI_CAT,
+  BI_CD,
+  BI_EXIT,
+  BI_HASH,
+  BI_HISTORY,
+  BI_JOBS,
+  BI_PARALLEL,
+  BI_PATH,
+  BI_PIPESTATUS,
+  BI_SET,
+  BI_STATS,
+  BI_TEE,
+  BI_TIME,
+  BI_UNALIAS,
+  BI_WAIT,
+  BI_WHICH,
+  BI_COUNT
+};
+
+static const Builtin builtins[BI_COUNT] = {
+    [BI_ALIAS] = {"alias", builtin_alias, 0},
+    [BI_CAT] = {"cat", builtin_cat, BUILTIN_STDIN, ""},
+    [BI_CD] = {"cd", builtin_cd, 0},
+    [BI_EXIT] = {"exit", builtin_exit, 0},
+    [BI_HASH] = {"hash", builtin_hash, 0},
+    [BI_HISTORY] = {"history", builtin_history, 0},
+    [BI_JOBS] = {"jobs", builtin_jobs, 0},
+    [BI_PARALLEL] = {"parallel", builtin_parallel, BUILTIN_STDIN},
+    [BI_PATH] = {"path", builtin_path, 0},
+    [BI_PIPESTATUS] = {"pipestatus", builtin_pipestatus, 0},
+    [BI_SET] = {"set", builtin_set, 0},
+    [BI_STATS] = {"stats", builtin_stats, 0},
+    [BI_TEE] = {"tee", builtin_tee, BUILTIN_STDIN, "a"},
+    [BI_TIME] = {"time", builtin_time, 0},
+    [BI_UNALIAS] = {"unalias", builtin_unalias, 0},
+    [BI_WAIT] = {"wait", builtin_wait, 0},
+    [BI_WHICH] = {"which", builtin_which, 0},
+};
+
+#define BUILTIN_MAX_NAME 10 /* strlen of the longest builtin name */
+#define BKEY(len, c) (((len) << 8) | (c))
+
+/*
+ * Registry entry for name, or NULL if it is not a builtin. Dispatches on
+ * (length, first char) so an external command costs at most one switch and
+ * one memcmp; keep the cases in sync with builtins[].
+ */
+static const Builtin *find_builtin(const char *name)
+{
+  if (!name)
+    return NULL;
+
+  size_t len = strnlen(name, BUILTIN_MAX_NAME + 1);
+  int idx;
+  switch (BKEY(len, (unsigned char)name[0]))
+  {
+  case BKEY(2, 'c'):
+    idx = BI_CD;
+    break;
+  case BKEY(3, 'c'):
+    idx = BI_CAT;
+    break;
+  case BKEY(3, 's'):
+    idx = BI_SET;
+    break;
+  case BKEY(3, 't'):
+    idx = BI_TEE;
+    break;
+  case BKEY(4, 'e'):
+    idx = BI_EXIT;
+    break;
+  case BKEY(4, 'h'):
+    idx = BI_HASH;
+    break;
+  case BKEY(4, 'j'):
+    idx = BI_JOBS;
+    break;
+  case BKEY(4, 't'):
+    idx = BI_TIME;
+    break;
+  case BKEY(4, 'w'):
+    idx = BI_WAIT;
+    break;
+  case BKEY(4, 'p'):
+    idx = BI_PATH;
+    break;
+  case BKEY(5, 'a'):
+    idx = BI_ALIAS;
+    break;
+  case BKEY(5, 's'):
+    idx = BI_STATS;
+    break;
+  case BKEY(5, 'w'):
+    idx = BI_WHICH;
+    break;
+  case BKEY(7, 'h'):
+    idx = BI_HISTORY;
+    break;
+  case BKEY(7, 'u'):
+    idx = BI_UNALIAS;
+    break;
+  case BKEY(8, 'p'):
+    idx = BI_PARALLEL;
+    break;
+  case BKEY(10, 'p'):
+    idx = BI_PIPESTATUS;
+    break;
+  default:
+    return NULL;
+  }
+  return memcmp(name, builtins[idx].name, len) == 0 ? &builtins[idx] : NULL;
+}
+
+/*
+ * The builtin to run for argv, or NULL for an external command: a stand-in
+ * for an external command only takes the lone-letter options in its opts
+ * (a lone "-" is stdin, not an option).
+ */
+static const Builtin *find_builtin_for(char **argv)
+{
+  const Builtin *b = find_builtin(argv[0]);
+  if (!b || !b->opts)
+    return b;
+  for (int i = 1; argv[i]; i++)
+  {
+    const char *a = argv[i];
+    if (a[0] == '-' && a[1] != '\0' && (a[2] != '\0' || !strchr(b->opts, a[1])))
+      return NULL;
+  }
+  return b;
+}
+
+/*
+ * If in_argv[0] is an alias, build the expanded argv in *out_argv. The result
+ * lives in cmd_arena; trailing arguments still point into in_argv.
+ */
+static int maybe_expand_leading_alias(char **in_argv, int in_argc,
+                                      char ***out_argv, int *out_argc)
+{
+  *out_argv = NULL;
+  *out_argc = 0;
+
+  if (in_argc == 0 || !in_argv[0])
+    return 0;
+
+  const char *val = hm_get(alias_hm, in_argv[0]);
+  if (!val)
+    return 0;
+  uint64_t t0 = TRACE_BEGIN();
+
+  char *buf = arena_strdup(cmd_arena, val);
+  stats.aliases++;
+  stats.parse_allocs++;
+  stats.parse_bytes += strlen(val) + 1;
+
+  ArgVec av = {.arena = cmd_arena};
+  parseline_inplace(buf, &av);
+  av_reserve(&av, av.argc + in_argc);
+  for (int i = 1; i < in_argc; i++)
+    av.argv[av.argc++] = in_argv[i];
+  av.argv[av.argc] = NULL;
+
+  *out_argv = av.argv;
+  *out_argc = av.argc;
+  TRACE_END("alias", t0, in_argv[0], 0);
+  return 1;
+}
+
+/*
+ * Reap the n stages of a pipeline in the order they finish, filling in each
+ * stage's status, end time and usage. Stages with pids[i] <= 0 (in-process builtins,
+ * stages that never started) are already done. No stage is signalled: by now
+ * the shell holds no pipe end, so once a stage exits, a producer writing to
+ * it gets EPIPE/SIGPIPE from the kernel on its next write, while one that
+ * never writes again (sleep 1 | true) finishes with its own status.
+ * Falls back to waiting in order if pidfds are unavailable.
+ */
+static void wait_stages(const pid_t *pids, StageResult *stages, int n)
+{
+  struct pollfd *pfds = arena_alloc(cmd_arena, n * sizeof(struct pollfd));
+  int *stage_of = arena_alloc(cmd_arena, n * sizeof(int));
+  int running = 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    if (pids[i] <= 0)
+      continue;
+    int fd = pidfd_open(pids[i], 0);
+    if (fd < 0)
+    {
+      for (int k = 0; k < running; k++)
+        close(pfds[k].fd);
+      for (int j = 0; j < n; j++)
+      {
+        if (pids[j] > 0)
+          stage_reap(&stages[j], pids[j]);
+      }
+      return;
+    }
+    pfds[running].fd = fd;
+    pfds[running].events = POLLIN;
+    stage_of[running] = i;
+    running++;
+  }
+
+  int left = running;
+  while (left > 0)
+  {
+    int ready = poll(pfds, running, -1);
+    if (ready < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      for (int k = 0; k < running; k++)
+      {
+        if (pfds[k].fd >= 0)
+          pfds[k].revents = POLLIN; /* fall back to blocking waits */
+      }
+    }
+
+    for (int k = 0; k < running; k++)
+    {
+      if (pfds[k].fd < 0 || !pfds[k].revents)
+        continue;
+      int i = stage_of[k];
+      stage_reap(&stages[i], pids[i]);
+      close(pfds[k].fd);
+      pfds[k].fd = -1; /* poll skips negative descriptors */
+      left--;
+    }
+  }
+}
+
+/* Put back the standard streams saved by run_builtin_to_fd */
+static void restore_std_fds(int saved[3])
 {
-  if (argc != 2 || !argv[1] || argv[1][0] == '\0')
+  for (int fd = 0; fd < 3; fd++)
   {
-    fprintf(stderr, INVALID_UNALIAS_USE);
-    return EXIT_FAILURE;
+    if (saved[fd] < 0)
+      continue;
+    dup2(saved[fd], fd);
+    close(saved[fd]);
   }
-  hm_delete(alias_hm, argv[1]);
-  return EXIT_SUCCESS;
 }
 
-static int maybe_expand_leading_alias(char **in_argv, int in_argc,
-                                      char ***out_argv, int *out_argc)
+/*
+ * Run a builtin in the shell with its stdin, stdout and stderr temporarily
+ * pointed at in_fd, out_fd and err_fd (-1 keeps the current one). SIGPIPE
+ * is ignored meanwhile so a reader that went away shows up as a failed
+ * write instead of killing the shell.
+ */
+static int run_builtin_to_fd(const Builtin *b, int argc, char **argv, int in_fd, int out_fd,
+                             int err_fd)
 {
-  *out_argv = NULL;
-  *out_argc = 0;
+  if (in_fd < 0 && out_fd < 0 && err_fd < 0)
+    return b->fn(argc, argv);
 
-  if (in_argc == 0 || !in_argv[0])
-    return 0;
+  fflush(stdout);
+  int src[3] = {in_fd, out_fd, err_fd};
+  int saved[3] = {-1, -1, -1};
+  for (int fd = 0; fd < 3; fd++)
+  {
+    if (src[fd] < 0)
+      continue;
+    /* Saved copies are close-on-exec so the builtin's own children skip them */
+    if ((saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 3)) < 0 || dup2(src[fd], fd) < 0)
+    {
+      perror("dup");
+      restore_std_fds(saved);
+      return EXIT_FAILURE;
+    }
+  }
+  void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
 
-  const char *val = hm_get(alias_hm, in_argv[0]);
-  if (!val)
-    return 0;
+  int code = b->fn(argc, argv);
 
-  char *tmp_argv[MAX_ARGS];
-  int tmp_argc = 0;
-  parseline_no_subst(val, tmp_argv, &tmp_argc);
+  fflush(stdout);
+  clearerr(stdout);
+  signal(SIGPIPE, old_pipe);
+  restore_std_fds(saved);
+  return code;
+}
 
-  char **new_argv = (char **)calloc(MAX_ARGS, sizeof(char *));
-  if (!new_argv)
+/*
+ * Run a builtin in a forked child, for stages that must run concurrently
+ * with the rest of the pipeline. The child keeps only stdin/stdout/stderr:
+ * without exec, close-on-exec does not apply, and a stray pipe end would
+ * keep another stage from seeing EOF.
+ */
+static pid_t launch_builtin(const Builtin *b, int argc, char **argv, int in_fd, int out_fd,
+                            int err_fd)
+{
+  fflush(stdout);
+  uint64_t t0 = TRACE_BEGIN();
+  stats.forks++;
+  pid_t pid = fork();
+  if (pid < 0)
   {
-    perror("calloc");
-    for (int i = 0; i < tmp_argc; i++)
-      free(tmp_argv[i]);
-    return 0;
+    perror("fork");
+    return -1;
   }
-
-  int new_argc = 0;
-  for (int i = 0; i < tmp_argc && new_argc < MAX_ARGS - 1; i++)
+  if (pid == 0)
   {
-    new_argv[new_argc] = strdup(tmp_argv[i]);
-    if (!new_argv[new_argc])
-      perror("strdup");
-    new_argc++;
+    if (in_fd >= 0 && dup2(in_fd, STDIN_FILENO) < 0)
+      _exit(1);
+    if (out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0)
+      _exit(1);
+    if (err_fd >= 0 && dup2(err_fd, STDERR_FILENO) < 0)
+      _exit(1);
+    close_range(3, ~0U, 0);
+    signal(SIGPIPE, SIG_DFL);
+    int code = b->fn(argc, argv);
+    fflush(stdout);
+    _exit(code == EXIT_SUCCESS ? 0 : 1);
   }
-  for (int i = 1; i < in_argc && new_argc < MAX_ARGS - 1; i++)
+  TRACE_END("fork", t0, argv[0], pid);
+  return pid;
+}
+
+static void timeval_sub(struct timeval *a, const struct timeval *b)
+{
+  a->tv_sec -= b->tv_sec;
+  a->tv_usec -= b->tv_usec;
+  if (a->tv_usec < 0)
   {
-    new_argv[new_argc] = strdup(in_argv[i]);
-    if (!new_argv[new_argc])
-      perror("strdup");
-    new_argc++;
+    a->tv_sec--;
+    a->tv_usec += 1000000;
   }
-  new_argv[new_argc] = NULL;
-
-  for (int i = 0; i < tmp_argc; i++)
-    free(tmp_argv[i]);
+}
 
-  *out_argv = new_argv;
-  *out_argc = new_argc;
-  return 1;
+/*
+ * Run an in-process builtin as stage st with its standard streams taken from
+ * r (-1 keeps the shell's); its usage is the shell's own delta. Max RSS
+ * is left at 0: the shell's peak covers its whole lifetime, not this stage
+ */
+static int stage_run_builtin(StageResult *st, const Builtin *b, int argc, char **argv,
+                             const Redirs *r)
+{
+  struct rusage before;
+  getrusage(RUSAGE_SELF, &before);
+  uint64_t t0 = TRACE_BEGIN();
+  stats.builtins++;
+  int code = run_builtin_to_fd(b, argc, argv, r->in, r->out, r->err);
+  TRACE_END("builtin", t0, argv[0], 0);
+  getrusage(RUSAGE_SELF, &st->usage);
+  clock_gettime(CLOCK_MONOTONIC, &st->end);
+
+  timeval_sub(&st->usage.ru_utime, &before.ru_utime);
+  timeval_sub(&st->usage.ru_stime, &before.ru_stime);
+  st->usage.ru_nvcsw -= before.ru_nvcsw;
+  st->usage.ru_nivcsw -= before.ru_nivcsw;
+  st->usage.ru_maxrss = 0;
+  st->status = W_EXITCODE(code == EXIT_SUCCESS ? 0 : 1, 0);
+  return code;
 }
 
-static void free_heap_argv(char **argv, int argc)
+/* Close-on-exec pipe for a pipeline, resized to pipe_size if configured */
+static int make_pipe(int fds[2])
 {
-  if (!argv)
-    return;
-  for (int i = 0; i < argc; i++)
-    free(argv[i]);
-  free(argv);
+  if (pipe2(fds, O_CLOEXEC) < 0)
+    return -1;
+  /* Best effort: unprivileged users cannot exceed /proc/sys/fs/pipe-max-size */
+  if (pipe_size > 0)
+    fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+  return 0;
 }
 
 static int run_pipeline(char **argv, int argc)
 {
   int segs = 1;
   for (int i = 0; i < argc; i++)
-    if (strcmp(argv[i], "|") == 0)
+    if (argv[i] == op_pipe)
       segs++;
-  if (segs > 128)
-    segs = 128;
 
-  char **seg_argvs[128];
-  int seg_argcs[128];
-  char **exp_argvs[128];
-  int exp_argcs[128];
-  char *exec_paths[128];
+  /* Everything below lives in cmd_arena, so error paths only close the redirections */
+  char ***seg_argvs = arena_alloc(cmd_arena, segs * sizeof(char **));
+  int *seg_argcs = arena_alloc(cmd_arena, segs * sizeof(int));
+  const char **exec_paths = arena_alloc(cmd_arena, segs * sizeof(char *));
+  /* One spare NULL entry: the launch loop looks at the stage after each one */
+  const Builtin **seg_builtins = arena_calloc(cmd_arena, segs + 1, sizeof(Builtin *));
+  /* Files opened for each stage's redirections; closed once the stage has started */
+  Redirs *seg_redirs = arena_alloc(cmd_arena, segs * sizeof(Redirs));
+  for (int i = 0; i < segs; i++)
+    seg_redirs[i] = (Redirs){-1, -1, -1};
 
   int start = 0;
   int seg_index = 0;
 
   for (int i = 0; i <= argc; i++)
   {
-    int is_pipe = (i < argc && strcmp(argv[i], "|") == 0);
+    int is_pipe = (i < argc && argv[i] == op_pipe);
     if (is_pipe || i == argc)
     {
-      int end = i;
-      int n = end - start;
-
-      char **out = (char **)calloc(MAX_ARGS, sizeof(char *));
-      int c = 0;
-      if (!out)
-      {
-        perror("calloc");
-        return EXIT_FAILURE;
-      }
-      for (int j = start; j < end && c < MAX_ARGS - 1; j++)
+      int n = i - start;
+      if (n == 0)
       {
-        out[c] = strdup(argv[j]);
-        if (!out[c])
-          perror("strdup");
-        c++;
+        fprintf(stderr, EMPTY_PIPE_SEGMENT);
+        goto fail;
       }
-      out[c] = NULL;
+
+      char **out = arena_alloc(cmd_arena, (n + 1) * sizeof(char *));
+      memcpy(out, argv + start, n * sizeof(char *));
+      out[n] = NULL;
 
       seg_argvs[seg_index] = out;
-      seg_argcs[seg_index] = c;
-      exp_argvs[seg_index] = NULL;
-      exp_argcs[seg_index] = 0;
+      seg_argcs[seg_index] = n;
       exec_paths[seg_index] = NULL;
 
-      if (n == 0)
+      char **exp_argv = NULL;
+      int exp_argc = 0;
+      if (maybe_expand_leading_alias(out, n, &exp_argv, &exp_argc))
       {
-        fprintf(stderr, EMPTY_PIPE_SEGMENT);
-        for (int z = 0; z <= seg_index; z++)
-        {
-          if (exp_argvs[z])
-            free_heap_argv(exp_argvs[z], exp_argcs[z]);
-          if (seg_argvs[z])
-            free_heap_argv(seg_argvs[z], seg_argcs[z]);
-          if (exec_paths[z])
-            free(exec_paths[z]);
-        }
-        return EXIT_FAILURE;
+        seg_argvs[seg_index] = exp_argv;
+        seg_argcs[seg_index] = exp_argc;
       }
 
-      int expanded = maybe_expand_leading_alias(seg_argvs[seg_index],
-                                                seg_argcs[seg_index],
-                                                &exp_argvs[seg_index],
-                                                &exp_argcs[seg_index]);
-
-      char **use_argv = expanded ? exp_argvs[seg_index] : seg_argvs[seg_index];
+      char **use_argv = seg_argvs[seg_index];
+      if (parse_redirs(use_argv, &seg_argcs[seg_index], &seg_redirs[seg_index]) < 0)
+        goto fail;
+      if (seg_argcs[seg_index] == 0)
+      {
+        fprintf(stderr, EMPTY_PIPE_SEGMENT);
+        goto fail;
+      }
 
-      if (!is_builtin_name(use_argv[0]))
+      seg_builtins[seg_index] = find_builtin_for(use_argv);
+      if (seg_builtins[seg_index] == &builtins[BI_TIME])
+      {
+        fprintf(stderr, TIME_IN_PIPELINE);
+        goto fail;
+      }
+      if (!seg_builtins[seg_index])
       {
         if (is_abs_or_rel(use_argv[0]))
         {
           if (access(use_argv[0], X_OK) != 0)
           {
             fprintf(stderr, CMD_NOT_FOUND, use_argv[0]);
-            for (int z = 0; z <= seg_index; z++)
-            {
-              if (exp_argvs[z])
-                free_heap_argv(exp_argvs[z], exp_argcs[z]);
-              if (seg_argvs[z])
-                free_heap_argv(seg_argvs[z], seg_argcs[z]);
-              if (exec_paths[z])
-                free(exec_paths[z]);
-            }
-            return EXIT_FAILURE;
+            goto fail;
           }
         }
         else
         {
-          char *p = find_in_path(use_argv[0]);
+          const char *p = resolve_command(use_argv[0]);
           if (!p)
           {
             if (getenv("PATH") && getenv("PATH")[0] != '\0')
             {
               fprintf(stderr, CMD_NOT_FOUND, use_argv[0]);
             }
-            for (int z = 0; z <= seg_index; z++)
-            {
-              if (exp_argvs[z])
-                free_heap_argv(exp_argvs[z], exp_argcs[z]);
-              if (seg_argvs[z])
-                free_heap_argv(seg_argvs[z], seg_argcs[z]);
-              if (exec_paths[z])
-                free(exec_paths[z]);
-            }
-            return EXIT_FAILURE;
+            goto fail;
           }
           exec_paths[seg_index] = p;
         }
@@ -703,151 +2480,273 @@ static int run_pipeline(char **argv, int argc)
   }
 
   int segs_total = seg_index;
-
-  int pipes[127][2];
-  for (int i = 0; i < segs_total - 1; i++)
+  stats.pipelines++;
+  stats.stages += segs_total;
+
+  /*
+   * External stages start first; builtin stages then run in the shell. Each
+   * pipe is created just before the stage that writes into it and is
+   * close-on-exec, so a child inherits only the ends dup2'd onto its stdin
+   * and stdout, and the shell holds just the read end for the next stage
+   * plus the ends in-process builtin stages will use.
+   *
+   * In-process stages run one after another, so a builtin that reads stdin
+   * may only do so if no earlier stage runs in the shell: whatever feeds it
+   * must be able to make progress while it runs. Otherwise it is forked.
+   * One reading a redirected file depends on no other stage.
+   *
+   * A redirection replaces the pipe end for its stream: the pipe is still
+   * made, so the neighbouring stage sees EOF or EPIPE as with other shells.
+   * An in-process stage keeps its descriptors in seg_redirs until it runs.
+   */
+  pid_t *pids = arena_alloc(cmd_arena, segs_total * sizeof(pid_t));
+  int *in_shell = arena_alloc(cmd_arena, segs_total * sizeof(int));
+  int in_shell_seen = 0;
+  StageResult *stages = arena_calloc(cmd_arena, segs_total, sizeof(StageResult));
+  int in_fd = -1;
+  int launched = segs_total;
+  for (int i = 0; i < segs_total; i++)
   {
-    if (pipe(pipes[i]) < 0)
+    char **use_argv = seg_argvs[i];
+    const Builtin *b = seg_builtins[i];
+    Redirs *r = &seg_redirs[i];
+    pids[i] = 0;
+    in_shell[i] = b && (!(b->flags & BUILTIN_STDIN) || !in_shell_seen || r->in >= 0);
+    stage_begin(&stages[i], use_argv[0]);
+
+    int fds[2] = {-1, -1};
+    if (i < segs_total - 1 && make_pipe(fds) < 0)
     {
-      perror("pipe");
-      for (int z = 0; z < segs_total; z++)
-      {
-        if (exp_argvs[z])
-          free_heap_argv(exp_argvs[z], exp_argcs[z]);
-        if (seg_argvs[z])
-          free_heap_argv(seg_argvs[z], seg_argcs[z]);
-        if (exec_paths[z])
-          free(exec_paths[z]);
-      }
-      return EXIT_FAILURE;
+      perror("pipe2");
+      launched = i;
+      break;
     }
-  }
-
-  pid_t pids[128];
-  for (int i = 0; i < segs_total; i++)
-  {
-    char **use_argv = exp_argvs[i] ? exp_argvs[i] : seg_argvs[i];
-    int use_argc = exp_argvs[i] ? exp_argcs[i] : seg_argcs[i];
 
-    pids[i] = fork();
-    if (pids[i] < 0)
+    if (in_shell[i])
     {
-      perror("fork");
-      for (int k = 0; k < segs_total - 1; k++)
+      in_shell_seen = 1;
+      if (r->out < 0)
+        r->out = fds[1];
+      else if (fds[1] >= 0)
+        close(fds[1]);
+      if (r->in < 0 && (b->flags & BUILTIN_STDIN))
       {
-        close(pipes[k][0]);
-        close(pipes[k][1]);
+        r->in = in_fd;
+        in_fd = -1;
       }
-      for (int z = 0; z < segs_total; z++)
+    }
+    else if (b)
+    {
+      pids[i] = launch_builtin(b, seg_argcs[i], use_argv, r->in >= 0 ? r->in : in_fd,
+                               r->out >= 0 ? r->out : fds[1], r->err);
+      if (fds[1] >= 0)
+        close(fds[1]);
+      redirs_close(r);
+    }
+    else
+    {
+      /* A stage that fails to start is treated like one whose exec failed */
+      const char *path = exec_paths[i] ? exec_paths[i] : use_argv[0];
+      pids[i] = launch_external(path, use_argv, r->in >= 0 ? r->in : in_fd,
+                                r->out >= 0 ? r->out : fds[1], r->err);
+      if (pids[i] < 0 && exec_paths[i])
       {
-        if (exp_argvs[z])
-          free_heap_argv(exp_argvs[z], exp_argcs[z]);
-        if (seg_argvs[z])
-          free_heap_argv(seg_argvs[z], seg_argcs[z]);
-        if (exec_paths[z])
-          free(exec_paths[z]);
+        path_cache_forget(use_argv[0]);
+        exec_paths[i] = NULL;
       }
-      return EXIT_FAILURE;
+      if (fds[1] >= 0)
+        close(fds[1]);
+      redirs_close(r);
+    }
+    if (in_fd >= 0)
+      close(in_fd);
+
+    /*
+     * Most builtins never read stdin, so the read end feeding one is closed
+     * right away: its producer gets EPIPE instead of a deadlock.
+     */
+    in_fd = fds[0];
+    if (in_fd >= 0 && seg_builtins[i + 1] && !(seg_builtins[i + 1]->flags & BUILTIN_STDIN))
+    {
+      close(in_fd);
+      in_fd = -1;
     }
+  }
+  if (in_fd >= 0)
+    close(in_fd);
+
+  /* Stages after a failed pipe2 never start */
+  for (int i = launched; i < segs_total; i++)
+  {
+    pids[i] = -1;
+    redirs_close(&seg_redirs[i]);
+    stage_begin(&stages[i], seg_argvs[i][0]);
+    stage_fail(&stages[i], 1);
+  }
 
-    if (pids[i] == 0)
+  for (int i = 0; i < launched; i++)
+  {
+    if (!in_shell[i])
     {
-      if (i > 0)
-      {
-        if (dup2(pipes[i - 1][0], STDIN_FILENO) < 0)
-          _exit(1);
-      }
-      if (i < segs_total - 1)
-      {
-        if (dup2(pipes[i][1], STDOUT_FILENO) < 0)
-          _exit(1);
-      }
+      if (pids[i] < 0)
+        stage_fail(&stages[i], EXEC_FAILED_STATUS);
+      continue;
+    }
+    stage_begin(&stages[i], seg_argvs[i][0]);
+    stage_run_builtin(&stages[i], seg_builtins[i], seg_argcs[i], seg_argvs[i], &seg_redirs[i]);
+    redirs_close(&seg_redirs[i]);
+  }
 
-      for (int k = 0; k < segs_total - 1; k++)
-      {
-        close(pipes[k][0]);
-        close(pipes[k][1]);
-      }
+  uint64_t t0 = TRACE_BEGIN();
+  unsigned long w0 = monotonic_ns();
+  wait_stages(pids, stages, segs_total);
+  stats.wait_ns += monotonic_ns() - w0;
+  stats.waits++;
+  TRACE_END("wait", t0, seg_argvs[0][0], 0);
 
-      if (is_builtin_name(use_argv[0]))
-      {
-        int code;
-        if (strcmp(use_argv[0], "exit") == 0)
-          code = builtin_exit(use_argc, use_argv);
-        else if (strcmp(use_argv[0], "path") == 0)
-          code = builtin_path(use_argc, use_argv);
-        else if (strcmp(use_argv[0], "cd") == 0)
-          code = builtin_cd(use_argc, use_argv);
-        else if (strcmp(use_argv[0], "which") == 0)
-          code = builtin_which(use_argc, use_argv);
-        else if (strcmp(use_argv[0], "history") == 0)
-          code = builtin_history(use_argc, use_argv);
-        else if (strcmp(use_argv[0], "alias") == 0)
-          code = builtin_alias(use_argc, use_argv);
-        else if (strcmp(use_argv[0], "unalias") == 0)
-          code = builtin_unalias(use_argc, use_argv);
-        else
-          code = EXIT_FAILURE;
-        _exit(code == EXIT_SUCCESS ? 0 : 1);
-      }
-      else
+  for (int i = 0; i < segs_total; i++)
+  {
+    if (pids[i] > 0 && exec_paths[i] && WIFEXITED(stages[i].status) &&
+        WEXITSTATUS(stages[i].status) == EXEC_FAILED_STATUS)
+      path_cache_forget(seg_argvs[i][0]);
+  }
+  record_stages(stages, segs_total);
+
+  /* With pipefail the rightmost failing stage decides, else the last one */
+  int result = stages[segs_total - 1].status;
+  if (opt_pipefail)
+  {
+    for (int i = segs_total - 1; i >= 0; i--)
+    {
+      if (status_code(stages[i].status) != 0)
       {
-        if (exec_paths[i])
-        {
-          execv(exec_paths[i], use_argv);
-        }
-        else
-        {
-          execv(use_argv[0], use_argv);
-        }
-        fprintf(stderr, CMD_NOT_FOUND, use_argv[0]);
-        _exit(1);
+        result = stages[i].status;
+        break;
       }
     }
   }
+  return status_code(result) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 
-  for (int k = 0; k < segs_total - 1; k++)
+fail:
+  for (int i = 0; i < segs; i++)
+    redirs_close(&seg_redirs[i]);
+  /* Nothing started; pipestatus and time must not show the previous command */
   {
-    close(pipes[k][0]);
-    close(pipes[k][1]);
+    StageResult st;
+    stage_begin(&st, argv[0]);
+    stage_fail(&st, 1);
+    record_stages(&st, 1);
   }
+  return EXIT_FAILURE;
+}
 
-  int last_status = 0;
-  for (int i = 0; i < segs_total; i++)
+/*
+ * Run a command line (without its trailing &) in a forked subshell and add
+ * it to the job table. Like other shells, builtins in the background change
+ * only the subshell, and a non-interactive job reads /dev/null.
+ */
+static int start_background(char **argv, int argc)
+{
+  StrBuf cmd = {0};
+  for (int i = 0; i < argc; i++)
+  {
+    if (i)
+      sb_add(&cmd, " ", 1);
+    sb_puts(&cmd, argv[i]);
+  }
+  sb_add(&cmd, "", 1);
+
+  if (jobs_len == jobs_cap)
   {
-    int st;
-    if (waitpid(pids[i], &st, 0) >= 0)
+    int cap = jobs_cap ? jobs_cap * 2 : 8;
+    Job *tmp = realloc(jobs, cap * sizeof(Job));
+    if (!tmp)
     {
-      if (i == segs_total - 1)
-        last_status = st;
+      perror("realloc");
+      sb_free(&cmd);
+      return EXIT_FAILURE;
     }
+    jobs = tmp;
+    jobs_cap = cap;
   }
 
-  for (int z = 0; z < segs_total; z++)
+  fflush(stdout);
+  stats.forks++;
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("fork");
+    sb_free(&cmd);
+    return EXIT_FAILURE;
+  }
+  if (pid == 0)
   {
-    if (exp_argvs[z])
-      free_heap_argv(exp_argvs[z], exp_argcs[z]);
-    if (seg_argvs[z])
-      free_heap_argv(seg_argvs[z], seg_argcs[z]);
-    if (exec_paths[z])
-      free(exec_paths[z]);
+    signal(SIGCHLD, SIG_DFL);
+    if (!interactive_shell)
+    {
+      int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+      if (null_fd >= 0)
+      {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+      }
+    }
+    int code = run_command(argv, argc);
+    fflush(stdout);
+    if (code == RC_EXIT_REQUEST)
+      _exit(rc);
+    if (code != EXIT_SUCCESS && last_stages_len > 0)
+    {
+      int last = status_code(last_stages[last_stages_len - 1].status);
+      _exit(last ? last : 1);
+    }
+    _exit(code == EXIT_SUCCESS ? 0 : 1);
   }
 
-  if (WIFEXITED(last_status))
+  Job *job = &jobs[jobs_len++];
+  job->id = next_job_id++;
+  job->pid = pid;
+  job->status = 0;
+  job->done = 0;
+  job->cmd = cmd.data;
+  if (interactive_shell)
   {
-    return (WEXITSTATUS(last_status) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    printf(JOB_STARTED, job->id, (int)pid);
+    fflush(stdout);
   }
-  return EXIT_FAILURE;
+
+  /* Starting a job succeeds; its own status is reported by jobs and wait */
+  StageResult st;
+  stage_begin(&st, argv[0]);
+  record_stages(&st, 1);
+  return EXIT_SUCCESS;
 }
 
 static int run_command(char **argv, int argc)
 {
   if (argc == 0)
     return EXIT_SUCCESS;
+  stats.commands++;
+
+  if (argv[argc - 1] == op_amp)
+  {
+    if (argc == 1)
+    {
+      fprintf(stderr, EMPTY_BACKGROUND);
+      return EXIT_FAILURE;
+    }
+    argv[argc - 1] = NULL;
+    return start_background(argv, argc - 1);
+  }
+
+  /* time covers the whole line, pipeline included, and reports its stages */
+  const Builtin *timer = &builtins[BI_TIME];
+  if (find_builtin(argv[0]) == timer)
+    return timer->fn(argc, argv);
 
   int has_pipe = 0;
   for (int i = 0; i < argc; i++)
-    if (strcmp(argv[i], "|") == 0)
+    if (argv[i] == op_pipe)
     {
       has_pipe = 1;
       break;
@@ -860,130 +2759,390 @@ static int run_command(char **argv, int argc)
   char **exp_argv = NULL;
   int exp_argc = 0;
 
-  int expanded = maybe_expand_leading_alias(argv, argc, &exp_argv, &exp_argc);
-  if (expanded)
+  if (maybe_expand_leading_alias(argv, argc, &exp_argv, &exp_argc))
   {
     use_argv = exp_argv;
     use_argc = exp_argc;
   }
 
+  const Builtin *b = find_builtin(use_argv[0]);
+  if (b == timer)
+    return b->fn(use_argc, use_argv);
+
+  Redirs r;
+  StageResult st;
+  stage_begin(&st, use_argv[0]);
+  if (parse_redirs(use_argv, &use_argc, &r) < 0)
+  {
+    stage_fail(&st, 1);
+    record_stages(&st, 1);
+    return EXIT_FAILURE;
+  }
+  /* A line of only redirections just creates (or truncates) its files */
+  if (use_argc == 0)
+  {
+    redirs_close(&r);
+    record_stages(&st, 1);
+    return EXIT_SUCCESS;
+  }
+
   int code;
-  if (is_builtin_name(use_argv[0]))
-  {
-    if (strcmp(use_argv[0], "exit") == 0)
-      code = builtin_exit(use_argc, use_argv);
-    else if (strcmp(use_argv[0], "path") == 0)
-      code = builtin_path(use_argc, use_argv);
-    else if (strcmp(use_argv[0], "cd") == 0)
-      code = builtin_cd(use_argc, use_argv);
-    else if (strcmp(use_argv[0], "which") == 0)
-      code = builtin_which(use_argc, use_argv);
-    else if (strcmp(use_argv[0], "history") == 0)
-      code = builtin_history(use_argc, use_argv);
-    else if (strcmp(use_argv[0], "alias") == 0)
-      code = builtin_alias(use_argc, use_argv);
-    else if (strcmp(use_argv[0], "unalias") == 0)
-      code = builtin_unalias(use_argc, use_argv);
-    else
-      code = EXIT_FAILURE;
+  b = find_builtin_for(use_argv);
+  if (b)
+  {
+    stage_begin(&st, use_argv[0]);
+    code = stage_run_builtin(&st, b, use_argc, use_argv, &r);
+    record_stages(&st, 1);
   }
   else
   {
-    code = execute_one(use_argv);
+    code = execute_one(use_argv, &r);
   }
-
-  if (expanded)
-    free_heap_argv(exp_argv, exp_argc);
+  redirs_close(&r);
   return code;
 }
 
+/*
+ * Run cmd (the inside of a $(...), parsed here so nested substitutions
+ * expand first) with stdout captured in a memfd, and append its output minus
+ * trailing newlines to out. Running through run_command keeps builtins in
+ * the shell, and since a memfd never fills up, a builtin writing more than
+ * a pipe holds cannot block with nobody reading.
+ */
+static int command_substitute(char *cmd, StrBuf *out)
+{
+  ArgVec av = {.arena = cmd_arena};
+  if (parseline_inplace(cmd, &av) < 0)
+    return -1;
+  if (av.argc == 0)
+    return 0;
+
+  int fd = memfd_create("wsh-subst", MFD_CLOEXEC);
+  if (fd < 0)
+  {
+    perror("memfd_create");
+    return -1;
+  }
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  if (saved < 0 || dup2(fd, STDOUT_FILENO) < 0)
+  {
+    perror("dup");
+    if (saved >= 0)
+      close(saved);
+    close(fd);
+    return -1;
+  }
+
+  uint64_t t0 = TRACE_BEGIN();
+  run_command(av.argv, av.argc);
+  TRACE_END("subst", t0, av.argv[0], 0);
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  /* Children shared the file offset, so the size is everything written */
+  struct stat st;
+  size_t start = out->len;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED)
+    {
+      sb_add(out, data, st.st_size);
+      munmap(data, st.st_size);
+    }
+  }
+  close(fd);
+
+  while (out->len > start && out->data[out->len - 1] == '\n')
+    out->len--;
+  return 0;
+}
+
+/* Copy the first len bytes of line plus a NUL into the reusable buffer sb */
+static char *copy_line(StrBuf *sb, const char *line, size_t len)
+{
+  sb->len = 0;
+  sb_add(sb, line, len);
+  sb_add(sb, "", 1);
+  return sb->data;
+}
+
+/*
+ * The line, its tokenized copy and argv are buffers that grow to the
+ * longest line seen and are reused, so reading and tokenizing a line
+ * allocates nothing once they are large enough.
+ */
 void interactive_main(void)
 {
-  char line[MAX_LINE];
-  char *argvv[MAX_ARGS];
-  int argc, i;
+  char *line = NULL;
+  size_t line_cap = 0;
+  StrBuf tokens = {0}; /* av points into this copy of line */
+  ArgVec av = {0};
 
+  interactive_shell = 1;
   while (1)
   {
+    jobs_notify();
     printf(PROMPT);
     fflush(stdout);
 
-    if (fgets(line, sizeof(line), stdin) == NULL)
+    ssize_t len = getline(&line, &line_cap, stdin);
+    if (len < 0)
     {
       if (ferror(stdin))
       {
-        fprintf(stderr, "fgets error\n");
+        perror("getline");
         rc = EXIT_FAILURE;
       }
       break;
     }
 
-    argc = 0;
-    parseline_no_subst(line, argvv, &argc);
-    if (argc == 0)
+    uint64_t t0 = TRACE_BEGIN();
+    parseline_inplace(copy_line(&tokens, line, len), &av);
+    TRACE_END("parse", t0, line, 0);
+    if (av.argc == 0)
       continue;
 
-    int code = run_command(argvv, argc);
+    t0 = TRACE_BEGIN();
+    int code = run_command(av.argv, av.argc);
+    TRACE_END("command", t0, line, 0);
+    arena_reset(cmd_arena);
     if (code == RC_EXIT_REQUEST)
-    {
-      for (i = 0; i < argc; i++)
-        free(argvv[i]);
       break; /* rc remains last non-exit code */
-    }
 
     rc = code;
     history_add_raw_line(line);
+  }
+
+  free(line);
+  sb_free(&tokens);
+  argvec_free(&av);
+}
+
+/*
+ * Cache file for script: a hash of its real path under SCRIPT_CACHE_ENV, or
+ * by default $XDG_CACHE_HOME/wsh (~/.cache/wsh). NULL if caching is off
+ * (SCRIPT_CACHE_ENV set empty) or no directory is available. Caller frees.
+ */
+static char *script_cache_file(const char *script)
+{
+  const char *dir = getenv(SCRIPT_CACHE_ENV);
+  StrBuf path = {0};
+  if (dir)
+  {
+    if (dir[0] == '\0')
+      return NULL;
+    sb_puts(&path, dir);
+  }
+  else
+  {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && xdg[0] != '\0')
+      sb_puts(&path, xdg);
+    else if (home && home[0] != '\0')
+      sb_printf(&path, "%s/.cache", home);
+    else
+      return NULL;
+    sb_add(&path, "", 1);
+    mkdir(path.data, 0700);
+    path.len--;
+    sb_puts(&path, "/" SCRIPT_CACHE_DIR);
+  }
+  sb_add(&path, "", 1);
+  if (mkdir(path.data, 0700) < 0 && errno != EEXIST)
+  {
+    sb_free(&path);
+    return NULL;
+  }
+  path.len--;
+
+  char *real = realpath(script, NULL);
+  if (!real)
+  {
+    sb_free(&path);
+    return NULL;
+  }
+  uint64_t h = 1469598103934665603ULL; /* FNV-1a */
+  for (const char *c = real; *c; c++)
+    h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+  free(real);
+  sb_printf(&path, "/%016llx.ir", (unsigned long long)h);
+  return path.data;
+}
+
+/*
+ * Compile a script into its IR: each line is tokenized once (lines with a
+ * substitution, a redirection or a parse error stay raw and are tokenized
+ * when they run, which also reproduces their error messages), and the first
+ * word of each pipeline stage that names an external command is resolved
+ * under the current PATH, outside the hash table and stats. Returns NULL if
+ * the script cannot be read.
+ */
+static ScriptIR *compile_script(FILE *fp, const struct stat *st)
+{
+  ScBuilder b = {0};
+  HashMap *seen = hm_create();
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t len;
+  StrBuf tokens = {0};
+  ArgVec av = {0};
+
+  while ((len = getline(&line, &line_cap, fp)) >= 0)
+  {
+    char *buf = copy_line(&tokens, line, len);
+    if (strstr(line, "$(") || parse_words(buf, &av, PARSE_QUIET) < 0)
+    {
+      sc_add_raw(&b, line);
+      continue;
+    }
+    if (av.argc == 0)
+      continue;
+    /*
+     * The IR does not record quoting, so '>' could not be told from >:
+     * such lines are tokenized at run time. A cached word reading | or &
+     * is therefore always the operator (see cached_word).
+     */
+    int ambiguous = 0;
+    for (int i = 0; i < av.argc && !ambiguous; i++)
+    {
+      const char *w = av.argv[i];
+      ambiguous = redir_op_len(w) != 0 ||
+                  (w != op_pipe && w != op_amp && (strcmp(w, "|") == 0 || strcmp(w, "&") == 0));
+    }
+    if (ambiguous)
+    {
+      sc_add_raw(&b, line);
+      continue;
+    }
+    sc_add_argv(&b, line, av.argv, av.argc);
 
-    for (i = 0; i < argc; i++)
-      free(argvv[i]);
+    for (int i = 0; i < av.argc; i++)
+    {
+      if (i > 0 && av.argv[i - 1] != op_pipe)
+        continue;
+      const char *name = av.argv[i];
+      if (find_builtin(name) || is_abs_or_rel(name) || hm_get(seen, name))
+        continue;
+      hm_put(seen, name, "");
+      const char *path = search_path(name, NULL);
+      if (path)
+        sc_add_path(&b, name, path);
+    }
+  }
+  hm_free(seen);
+  free(line);
+  sb_free(&tokens);
+  argvec_free(&av);
+
+  if (ferror(fp))
+  {
+    perror("getline");
+    sc_free(sc_finish(&b, st, NULL));
+    return NULL;
   }
+  return sc_finish(&b, st, getenv("PATH"));
 }
 
 int batch_main(const char *script_file)
 {
-  FILE *fp = fopen(script_file, "r");
+  FILE *fp = fopen(script_file, "re");
   if (!fp)
   {
     perror("fopen");
     return EXIT_FAILURE;
   }
 
-  char line[MAX_LINE];
-  char *argvv[MAX_ARGS];
-  int argc, i;
+  /*
+   * Regular files are compiled once per version: the IR is kept in a cache
+   * file keyed by the script's device, inode, size and mtime and mapped on
+   * later runs. Its resolved paths are used only while PATH is unchanged.
+   * A script modified less than SCRIPT_CACHE_MIN_AGE seconds ago is not
+   * cached: mtime has coarse granularity, so a rewrite within the same tick
+   * that keeps the size could otherwise go unnoticed.
+   */
+  struct stat st;
+  char *cache_file = NULL;
+  ScriptIR *ir = NULL;
+  if (fstat(fileno(fp), &st) < 0)
+    memset(&st, 0, sizeof(st));
+  uint64_t t0 = TRACE_BEGIN();
+  if (S_ISREG(st.st_mode))
+  {
+    cache_file = script_cache_file(script_file);
+    if (cache_file)
+      ir = sc_load(cache_file, &st);
+  }
+  if (!ir)
+  {
+    ir = compile_script(fp, &st);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (ir && cache_file && now.tv_sec - st.st_mtim.tv_sec >= SCRIPT_CACHE_MIN_AGE)
+      sc_save(ir, cache_file);
+  }
+  /* Resolutions reach the hash table (and its counters) only when their command runs */
+  const char *env_path = getenv("PATH");
+  if (ir && strcmp(sc_env_path(ir), env_path ? env_path : "") == 0)
+  {
+    const char *name, *path;
+    script_paths = hm_create();
+    for (size_t pos = 0; sc_next_path(ir, &pos, &name, &path);)
+      hm_put(script_paths, name, path);
+  }
+  TRACE_END(ir && ir->mapped ? "load" : "compile", t0, script_file, 0);
+  fclose(fp);
+  free(cache_file);
+  if (!ir)
+    return EXIT_FAILURE;
+
+  StrBuf tokens = {0}; /* av points into this copy of a raw line */
+  ArgVec av = {0};
+  ScLine ln;
 
-  while (fgets(line, sizeof(line), fp) != NULL)
+  for (size_t pos = 0; sc_next_line(ir, &pos, &ln);)
   {
-    argc = 0;
-    parseline_no_subst(line, argvv, &argc);
-    if (argc > 0)
+    if (ln.flags & SC_LINE_RAW)
     {
-      int code = run_command(argvv, argc);
-
-      if (code == RC_EXIT_REQUEST)
+      t0 = TRACE_BEGIN();
+      parseline_inplace(copy_line(&tokens, ln.line, strlen(ln.line)), &av);
+      TRACE_END("parse", t0, ln.line, 0);
+      if (av.argc == 0)
+        continue;
+    }
+    else
+    {
+      char *word = ln.args;
+      av_reserve(&av, ln.argc + 1);
+      av.argc = ln.argc;
+      for (int i = 0; i < av.argc; i++)
       {
-        for (i = 0; i < argc; i++)
-          free(argvv[i]);
-        fclose(fp);
-        return rc;
+        av.argv[i] = cached_word(word);
+        word += strlen(word) + 1;
       }
+      av.argv[av.argc] = NULL;
+    }
 
-      rc = code;
-      history_add_raw_line(line);
+    jobs_reap(0);
+    t0 = TRACE_BEGIN();
+    int code = run_command(av.argv, av.argc);
+    TRACE_END("command", t0, ln.line, 0);
+    arena_reset(cmd_arena);
 
-      for (i = 0; i < argc; i++)
-        free(argvv[i]);
-    }
-  }
+    if (code == RC_EXIT_REQUEST)
+      break; /* rc remains last non-exit code */
 
-  if (ferror(fp))
-  {
-    perror("fgets");
-    fclose(fp);
-    return EXIT_FAILURE;
+    rc = code;
+    history_add_raw_line(ln.line);
   }
 
-  fclose(fp);
+  sb_free(&tokens);
+  argvec_free(&av);
+  sc_free(ir);
   return rc;
 }
 
@@ -993,16 +3152,28 @@ int main(int argc, char **argv)
   setvbuf(stderr, NULL, _IONBF, 0);
 
   alias_hm = hm_create();
+  cmd_arena = arena_create(4096);
+  jobs_init();
   history_init();
 
   setenv("PATH", "/bin", 1);
 
+  const char *launch = getenv(LAUNCH_ENV);
+  if (launch && strcmp(launch, "fork") == 0)
+    launch_mode = LAUNCH_FORK;
+  pipe_size_init();
+  const char *trace = getenv(TRACE_ENV);
+  if (trace && trace[0] != '\0')
+    trace_init(trace);
+
   if (argc > 2)
   {
     wsh_warn(INVALID_WSH_USE);
     return EXIT_FAILURE;
   }
 
+  history_open_file(argc == 1);
+
   if (argc == 1)
     interactive_main();
   else
@@ -1,28 +1,51 @@
 #ifndef WSH_H
 #define WSH_H
 
+#include "arena.h"
+
 /**************************************************
  * Constants
  *************************************************/
-#define MAX_LINE 1024 /* max line size */
-#define MAX_ARGS 128  /* max args on a command line */
-
 #define PROMPT "wsh> " /* prompt */
+#define HISTSIZE_ENV "HISTSIZE" /* max number of history entries kept */
+#define HISTSIZE_DEFAULT 1000
+#define HISTFILE_ENV "HISTFILE" /* history file; empty disables persistence */
+#define HISTFILE_DEFAULT ".wsh_history" /* under $HOME, interactive mode only */
+#define PIPE_SIZE_ENV "WSH_PIPE_SIZE" /* pipe buffer size for pipelines, e.g. 1m */
+#define PIPE_SIZE_MAX (1 << 30)
+#define SCRIPT_CACHE_ENV "WSH_SCRIPT_CACHE" /* directory for compiled scripts; empty disables */
+#define SCRIPT_CACHE_DIR "wsh" /* default: under $XDG_CACHE_HOME or ~/.cache */
+#define SCRIPT_CACHE_MIN_AGE 2 /* seconds since a script's last change before it is cached */
+#define TRACE_ENV "WSH_TRACE" /* write a Chrome trace of this run to the given file */
+#define LAUNCH_ENV "WSH_LAUNCH" /* "fork" selects fork+execv, otherwise posix_spawn */
 #define INVALID_WSH_USE "Invalid usage of wsh. Correct format: wsh | wsh batch_file\n"
 
 #define CMD_NOT_FOUND "Command not found or not an executable: %s\n"
 #define EMPTY_PIPE_SEGMENT "Empty command segment in pipeline\n"
+#define EMPTY_BACKGROUND "Missing command before &\n"
 #define EMPTY_PATH "PATH empty or not set\n"
 #define MISSING_CLOSING_QUOTE "Missing Closing Quote\n"
+#define INVALID_PIPE_SIZE "Ignoring invalid WSH_PIPE_SIZE: %s\n"
 #define UNMATCHED_PAREN "Unmatched parentheses in command substitution\n"
+#define REDIRECT_NO_FILE "Missing file name after %s\n"
+#define REDIRECT_UNSUPPORTED "Unsupported redirection to %s\n" /* e.g. 2>&1 */
+#define REDIRECT_OPEN_FAILED "%s: %s\n" /* file, strerror */
 
 #define INVALID_PATH_USE "Incorrect usage of path. Correct format: path dir1:dir2:...:dirN\n"
 #define INVALID_EXIT_USE "Incorrect usage of exit. Too many arguments\n"
-#define INVALID_ALIAS_USE "Incorrect usage of alias. Correct format: alias | alias name = 'command'\n"
+#define INVALID_ALIAS_USE "Incorrect usage of alias. Correct format: alias | alias prefix* | alias name = 'command'\n"
 #define INVALID_UNALIAS_USE "Incorrect usage of unalias. Correct format: unalias name\n"
 #define INVALID_WHICH_USE "Incorrect usage of which. Correct format: which name\n"
 #define INVALID_CD_USE "Incorrect usage of cd. Correct format: cd | cd directory\n"
-#define INVALID_HISTORY_USE "Incorrect usage of history. Correct format: history | history n\n"
+#define INVALID_HISTORY_USE "Incorrect usage of history. Correct format: history | history n | history -s substring | history -p prefix\n"
+#define INVALID_SET_USE "Incorrect usage of set. Correct format: set | set -o option | set +o option\n"
+#define INVALID_PIPESTATUS_USE "Incorrect usage of pipestatus. Correct format: pipestatus\n"
+#define INVALID_TIME_USE "Incorrect usage of time. Correct format: time [-m] command\n"
+#define TIME_IN_PIPELINE "time must come first and applies to the whole pipeline\n"
+#define INVALID_JOBS_USE "Incorrect usage of jobs. Correct format: jobs\n"
+#define INVALID_PARALLEL_USE "Incorrect usage of parallel. Correct format: parallel [-j N] [-k] command [args, {} = item] [::: item ...]\n"
+#define INVALID_HASH_USE "Incorrect usage of hash. Correct format: hash | hash -r | hash name ...\n"
+#define INVALID_STATS_USE "Incorrect usage of stats. Correct format: stats [-m] [-r]\n"
 
 #define WHICH_ALIAS "%s: aliased to '%s'\n"
 #define WHICH_BUILTIN "%s: wsh builtin\n"
@@ -32,6 +55,33 @@
 #define CD_NO_HOME "cd: HOME not set\n"
 
 #define HISTORY_INVALID_ARG "Invalid argument passed to history\n"
+#define HISTORY_MATCH "%5zu  %s\n" /* history -s/-p: entry number, line */
+
+#define SET_OPTION_STATE "%-12s %s\n" /* set: option name, on/off */
+
+/* time: label, exit code, real, user, sys (seconds), max RSS (KiB), voluntary/involuntary context switches */
+#define TIME_HEADER "stage        code       real       user        sys    maxrss    vcsw   ivcsw\n"
+#define TIME_ROW "%-12s %4d %9.3fs %9.3fs %9.3fs %8ldK %7ld %7ld\n"
+#define TIME_ROW_MACHINE "%s\t%d\t%.6f\t%.6f\t%.6f\t%ld\t%ld\t%ld\n"
+#define TIME_TOTAL_LABEL "total"
+
+#define BUILTIN_FILE_ERROR "%s: %s: %s\n" /* cat/tee: builtin, file, strerror */
+
+#define JOB_STARTED "[%d] %d\n" /* job id, pid */
+#define JOB_RUNNING "[%d]  Running     %s\n"
+#define JOB_DONE "[%d]  Done        %s\n"
+#define JOB_EXITED "[%d]  Exit %-6d %s\n"
+#define JOB_SIGNALED "[%d]  Signal %-4d %s\n"
+#define WAIT_NO_SUCH_JOB "wait: %s: no such job\n"
+
+#define PARALLEL_MAX_JOBS 4096
+#define PARALLEL_BUILTIN "parallel: %s: only external commands can be run\n"
+#define PARALLEL_JOB_FAILED "parallel: exit %d: %s\n" /* exit code, item */
+#define PARALLEL_SUMMARY "parallel: %d of %zu jobs failed\n"
+
+#define HASH_STATS "hits: %lu, misses: %lu\n"
+#define STATS_ROW "%-14s %lu\n"
+#define HASH_NOT_FOUND "hash: %s: not found\n"
 
 /**************************************************
  * Modes of Execution
@@ -42,7 +92,22 @@ int batch_main(const char *script_file); /* Read a commands from script_file lin
 /**************************************************
  * Parsing
  *************************************************/
-void parseline_no_subst(const char *cmdline, char **argv, int *argc);
+/* Growable NULL-terminated argv, reused across lines. Grows with realloc, or
+   from arena when that is set (such an ArgVec lives until the arena is reset) */
+typedef struct {
+    char **argv;
+    int argc;
+    int cap;
+    Arena *arena;
+} ArgVec;
+
+/* Release a heap-backed ArgVec's buffer */
+void argvec_free(ArgVec *av);
+
+/* Tokenize buf in place into av; words point into buf. Returns -1 on a parse error */
+int parseline_inplace(char *buf, ArgVec *av);
+/* Same quoting rules, but every word is a separate malloc'ed copy */
+void parseline_no_subst(const char *cmdline, ArgVec *av);
 
 
 /**************************************************